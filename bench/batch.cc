@@ -0,0 +1,55 @@
+// Throughput of BatchComputer for 1, 2, 4, ... threads up to the number of hardware threads.
+// Jobs run the same loop for different counts, so their lengths vary and workers steal.
+#include "../src/batch.h"
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+constexpr size_t JOBS = 20000;
+constexpr size_t N = 16;
+using Type = int64_t;
+
+// Sums counts from cell 15 down to 1.
+using tmpasm_sum = Program<
+        D<Id("acc"), Num<0>>,
+        Label<Id("loop")>,
+        Add<Mem<Lea<Id("acc")>>, Mem<Num<15>>>,
+        Dec<Mem<Num<15>>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+int main() {
+    BatchComputer<N, Type> batch;
+    size_t sum = batch.add_program<tmpasm_sum>();
+
+    std::vector<BatchComputer<N, Type>::Job> jobs(JOBS);
+    for (size_t i = 0; i < JOBS; ++i) {
+        jobs[i].program = sum;
+        jobs[i].memory[15] = static_cast<Type>(1000 + i % 4000);
+    }
+    std::vector<BatchComputer<N, Type>::Result> expected(JOBS), results(JOBS);
+    batch.run(jobs.data(), JOBS, expected.data(), 1);
+
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double base = 0;
+    for (unsigned threads = 1;; threads = std::min(threads * 2, max_threads)) {
+        auto start = std::chrono::steady_clock::now();
+        batch.run(jobs.data(), JOBS, results.data(), threads);
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+        double rate = JOBS / time.count();
+        if (threads == 1)
+            base = rate;
+        std::printf("%3u threads %8.3f s %12.0f jobs/s %6.2fx\n",
+                    threads, time.count(), rate, rate / base);
+        for (size_t i = 0; i < JOBS; ++i) {
+            if (results[i].error || results[i].memory != expected[i].memory)
+                return 1;
+        }
+        if (threads == max_threads)
+            break;
+    }
+    return 0;
+}
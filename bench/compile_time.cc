@@ -0,0 +1,265 @@
+// Measures how compiling Computer::boot scales. Generates programs varying one parameter at a
+// time, compiles each one and prints wall time, peak RSS of the compiler, template
+// instantiations (clang -ftime-trace) and constexpr steps (smallest passing limit).
+//
+// Usage: compile_time [--cxx COMPILER] [--src DIR] [--no-steps]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace {
+    struct Config {
+        const char *varied;
+        size_t instructions, labels, variables, iterations, depth;
+    };
+
+    constexpr Config BASE{"base", 64, 8, 8, 100, 1};
+
+    std::vector<Config> configs() {
+        std::vector<Config> ans{BASE};
+        for (size_t n : {128, 256, 512, 1024, 2048}) {
+            ans.push_back(BASE);
+            ans.back().varied = "instructions";
+            ans.back().instructions = n;
+        }
+        for (size_t n : {32, 128, 512}) {
+            ans.push_back(BASE);
+            ans.back().varied = "labels";
+            ans.back().labels = n;
+        }
+        for (size_t n : {64, 256, 1024}) {
+            ans.push_back(BASE);
+            ans.back().varied = "variables";
+            ans.back().variables = n;
+        }
+        for (size_t n : {1000, 10000}) {
+            ans.push_back(BASE);
+            ans.back().varied = "iterations";
+            ans.back().iterations = n;
+        }
+        for (size_t n : {4, 16, 64}) {
+            ans.push_back(BASE);
+            ans.back().varied = "depth";
+            ans.back().depth = n;
+        }
+        return ans;
+    }
+
+    std::string id(const char *prefix, size_t i) {
+        return "Id(\"" + std::string(prefix) + std::to_string(i) + "\")";
+    }
+
+    // Program running a loop over the body iterations times. Variables c0, c1, ... form a
+    // chain of pointers, so depth Mems of Lea<c(depth - 1)> reach c0. Every label is
+    // preceded by a jump to it, so labels are resolved too.
+    std::string generate(const Config &config) {
+        std::ostringstream out;
+        out << "#include \"computer.h\"\n\nusing tmpasm_generated = Program<\n";
+        for (size_t i = 0; i < config.depth; ++i)
+            out << "        D<" << id("c", i) << ", Num<" << (i == 0 ? 0 : i - 1) << ">>,\n";
+        for (size_t i = 0; i < config.variables; ++i)
+            out << "        D<" << id("v", i) << ", Num<" << i << ">>,\n";
+        out << "        D<Id(\"cnt\"), Num<" << config.iterations << ">>,\n";
+        out << "        Label<Id(\"loop\")>,\n";
+
+        std::string lvalue = "Lea<" + id("c", config.depth - 1) + ">";
+        for (size_t i = 0; i < config.depth; ++i)
+            lvalue = "Mem<" + lvalue + ">";
+        size_t labels = 0;
+        for (size_t i = 0; i < config.instructions; ++i) {
+            // Labels are spread evenly between instructions.
+            while (labels < config.labels &&
+                   labels * config.instructions <= i * config.labels) {
+                out << "        Js<" << id("l", labels) << ">,\n";
+                out << "        Label<" << id("l", labels) << ">,\n";
+                ++labels;
+            }
+            std::string pvalue = config.variables == 0 ? "Num<1>" :
+                                 "Mem<Lea<" + id("v", i % config.variables) + ">>";
+            const char *op = i % 3 == 0 ? "Add" : i % 3 == 1 ? "Sub" : "Cmp";
+            out << "        " << op << "<" << lvalue << ", " << pvalue << ">,\n";
+        }
+        for (; labels < config.labels; ++labels)
+            out << "        Label<" << id("l", labels) << ">,\n";
+        out << "        Dec<Mem<Lea<Id(\"cnt\")>>>,\n"
+               "        Jz<Id(\"end\")>,\n"
+               "        Jmp<Id(\"loop\")>,\n"
+               "        Label<Id(\"end\")>>;\n\n";
+        out << "constexpr auto memory = Computer<" << config.variables + config.depth + 1
+            << ", int64_t>::boot<tmpasm_generated>();\n\n"
+               "int main() {\n    return static_cast<int>(memory[0] & 1);\n}\n";
+        return out.str();
+    }
+
+    struct Result {
+        bool ok = false;
+        double seconds = 0;
+        long rss_kb = 0;
+    };
+
+    // Runs the compiler with output sent to log, measuring its wall time and peak RSS.
+    Result compile(const std::vector<std::string> &args, const std::string &log) {
+        std::vector<char *> argv;
+        for (const std::string &arg : args)
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 1, log.c_str(),
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        posix_spawn_file_actions_adddup2(&actions, 1, 2);
+
+        Result result;
+        auto start = std::chrono::steady_clock::now();
+        pid_t pid;
+        int status = 0;
+        rusage usage{};
+        if (posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ) == 0 &&
+            wait4(pid, &status, 0, &usage) == pid) {
+            std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+            result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            result.seconds = time.count();
+            // Usage of the driver includes the compiler processes it waited for.
+            result.rss_kb = usage.ru_maxrss;
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        return result;
+    }
+
+    // Gets a short reason of a failed compilation from its log.
+    const char *failure(const std::string &log) {
+        std::ifstream in(log);
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (text.find("instantiation depth") != std::string::npos)
+            return "template depth";
+        if (text.find("evaluation depth") != std::string::npos ||
+            text.find("maximum depth") != std::string::npos)
+            return "constexpr depth";
+        if (text.find("operation count") != std::string::npos ||
+            text.find("iteration count") != std::string::npos ||
+            text.find("step limit") != std::string::npos)
+            return "constexpr limit";
+        return "error";
+    }
+
+    // Counts template instantiation events in a clang -ftime-trace file.
+    long instantiations(const std::string &trace) {
+        std::ifstream in(trace);
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        long count = 0;
+        for (const char *event : {"\"InstantiateClass\"", "\"InstantiateFunction\""}) {
+            for (size_t pos = text.find(event); pos != std::string::npos;
+                 pos = text.find(event, pos + 1))
+                ++count;
+        }
+        return count;
+    }
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    std::string cxx = std::getenv("CXX") ? std::getenv("CXX") : "clang++";
+    std::string src = std::string(__FILE__).substr(0, std::string(__FILE__).rfind('/') + 1) +
+                      "../src";
+    bool steps = true;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--cxx") && i + 1 < argc)
+            cxx = argv[++i];
+        else if (!std::strcmp(argv[i], "--src") && i + 1 < argc)
+            src = argv[++i];
+        else if (!std::strcmp(argv[i], "--no-steps"))
+            steps = false;
+    }
+    char *real_src = realpath(src.c_str(), nullptr);
+    if (!real_src) {
+        std::fprintf(stderr, "Cannot find %s, use --src\n", src.c_str());
+        return 1;
+    }
+    src = real_src;
+    std::free(real_src);
+
+    char dir_template[] = "/tmp/tmpasm_compile_XXXXXX";
+    if (!mkdtemp(dir_template))
+        return 1;
+    std::string dir = dir_template;
+
+    // Clang has -ftime-trace and counts constexpr steps, GCC counts constexpr operations.
+    std::string version = dir + "/version.txt";
+    compile({cxx, "--version"}, version);
+    std::ifstream version_file(version);
+    std::string version_text((std::istreambuf_iterator<char>(version_file)),
+                             std::istreambuf_iterator<char>());
+    bool clang = version_text.find("clang") != std::string::npos;
+    std::string limit_flag = clang ? "-fconstexpr-steps=" : "-fconstexpr-ops-limit=";
+
+    std::printf("%-13s %6s %6s %6s %7s %6s %9s %9s %9s %12s\n", "varied", "instr", "labels",
+                "vars", "iters", "depth", "time [s]", "RSS [MB]", "instant.", "constexpr");
+    for (const Config &config : configs()) {
+        std::string source = dir + "/program.cc";
+        std::ofstream(source) << generate(config);
+        std::vector<std::string> args{cxx, "-std=c++17", "-c", "-I" + src, source,
+                                      "-o", dir + "/program.o"};
+        if (!clang)
+            args.push_back("-fconstexpr-loop-limit=" + std::to_string(INT_MAX));
+        // Measured without the step limit, so the table shows how far programs go past it.
+        std::vector<std::string> measured = args;
+        measured.push_back(limit_flag + std::to_string(UINT_MAX));
+        if (clang) {
+            measured.push_back("-ftime-trace");
+            measured.push_back("-ftime-trace-granularity=0");
+        }
+        Result result = compile(measured, dir + "/log.txt");
+
+        std::string count = "-", limit = "-";
+        if (result.ok && clang)
+            count = std::to_string(instantiations(dir + "/program.json"));
+        if (result.ok && steps) {
+            // Smallest passing limit, found by doubling and then bisecting to about 3%.
+            // Failing probes stop at the limit, so mostly passing ones take time.
+            auto passes = [&](unsigned long long n) {
+                std::vector<std::string> probe = args;
+                probe.push_back(limit_flag + std::to_string(n));
+                return compile(probe, dir + "/probe.txt").ok;
+            };
+            unsigned long long high = 1024;
+            while (high < UINT_MAX && !passes(high))
+                high *= 2;
+            if (high < UINT_MAX) {
+                unsigned long long low = high / 2;
+                for (int i = 0; i < 5 && low + 1 < high; ++i) {
+                    unsigned long long middle = low + (high - low) / 2;
+                    (passes(middle) ? high : low) = middle;
+                }
+                limit = std::to_string(high);
+            } else {
+                limit = "> limit";
+            }
+        }
+
+        std::printf("%-13s %6zu %6zu %6zu %7zu %6zu ", config.varied, config.instructions,
+                    config.labels, config.variables, config.iterations, config.depth);
+        if (result.ok) {
+            std::printf("%9.2f %9.1f %9s %12s\n", result.seconds, result.rss_kb / 1024.0,
+                        count.c_str(), limit.c_str());
+        } else {
+            std::printf("%9s %9.1f %9s %12s  %s\n", "failed", result.rss_kb / 1024.0, "-", "-",
+                        failure(dir + "/log.txt"));
+        }
+        std::fflush(stdout);
+    }
+    std::printf("\nFiles of the last program are in %s\n", dir.c_str());
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Compares naive switch dispatch (used by boot) with threaded code (used by run)
+// and, on Linux x86-64, with native code (used by JitComputer::run).
+#include "../src/computer.h"
+#if defined(__x86_64__) && defined(__linux__)
+#include "../src/jit.h"
+#endif
+#include <array>
+#include <chrono>
+#include <cstdio>
+
+constexpr uint64_t ITERATIONS = 50000000;
+// Executed instructions per loop iteration, labels excluded.
+constexpr uint64_t LOOP_SIZE = 7;
+
+using tmpasm_bench = Program<
+        D<Id("cnt"), Num<ITERATIONS>>,
+        D<Id("acc"), Num<0>>,
+        D<Id("ptr"), Num<8>>,
+        Label<Id("loop")>,
+        Add<Mem<Lea<Id("acc")>>, Mem<Lea<Id("cnt")>>>,
+        And<Mem<Lea<Id("acc")>>, Num<0xffff>>,
+        Mov<Mem<Mem<Lea<Id("ptr")>>>, Mem<Lea<Id("acc")>>>,
+        Cmp<Mem<Mem<Lea<Id("ptr")>>>, Num<0>>,
+        Dec<Mem<Lea<Id("cnt")>>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+constexpr size_t N = 16;
+using Type = int64_t;
+
+template<typename F>
+static double measure(const char *name, F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    double rate = ITERATIONS * LOOP_SIZE / time.count() / 1e6;
+    std::printf("%-10s %8.3f s %10.1f M instructions/s\n", name, time.count(), rate);
+    return rate;
+}
+
+int main() {
+    static constexpr auto code = Bytecode<tmpasm_bench>::decode();
+
+    std::array<Type, N> naive{};
+    double naive_rate = measure("naive", [&] {
+        tmpasm_bench::load_variables<N, Type, 0>(naive.data());
+        Flags<Type> flags;
+        execute(Memory<Type, N>{naive.data()}, flags, code.data(), code.size());
+    });
+
+    std::array<Type, N> threaded{};
+    double threaded_rate = measure("threaded", [&] {
+        Computer<N, Type>::run<tmpasm_bench>(threaded);
+    });
+
+    std::printf("speedup    %8.2fx\n", threaded_rate / naive_rate);
+    if (naive != threaded)
+        return 1;
+
+#if defined(__x86_64__) && defined(__linux__)
+    std::array<Type, N> jit{};
+    double jit_rate = measure("jit", [&] {
+        JitComputer<N, Type>::run<tmpasm_bench>(jit);
+    });
+    std::printf("speedup    %8.2fx\n", jit_rate / naive_rate);
+    if (naive != jit)
+        return 1;
+#endif
+    return 0;
+}
@@ -0,0 +1,79 @@
+// Compares LockstepComputer with running the same instances one by one (BatchComputer on one
+// thread). Build with -O3 -march=native to let the compiler use AVX2 or AVX-512.
+#include "../src/batch.h"
+#include "../src/lockstep.h"
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+constexpr size_t INSTANCES = 1 << 14;
+constexpr size_t LANES = 64;
+constexpr size_t N = 16;
+
+// Lanes diverge on js skip and join again at skip.
+using tmpasm_bench = Program<
+        D<Id("cnt"), Num<100>>,
+        Label<Id("loop")>,
+        Add<Mem<Num<8>>, Mem<Num<9>>>,
+        And<Mem<Num<8>>, Num<63>>,
+        Cmp<Mem<Num<8>>, Num<32>>,
+        Js<Id("skip")>,
+        Sub<Mem<Num<10>>, Mem<Num<8>>>,
+        Label<Id("skip")>,
+        Or<Mem<Num<11>>, Mem<Num<8>>>,
+        Not<Mem<Num<12>>>,
+        Dec<Mem<Lea<Id("cnt")>>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+template<typename F>
+static double measure(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    return time.count();
+}
+
+template<typename Type>
+static bool bench(const char *name) {
+    using Lockstep = LockstepComputer<N, Type, LANES>;
+    std::vector<typename Lockstep::Lanes> lanes(INSTANCES / LANES);
+
+    BatchComputer<N, Type> batch;
+    size_t program = batch.template add_program<tmpasm_bench>();
+    std::vector<typename BatchComputer<N, Type>::Job> jobs(INSTANCES);
+    for (size_t i = 0; i < INSTANCES; ++i) {
+        jobs[i].program = program;
+        for (size_t addr = 8; addr < N; ++addr) {
+            Type val = static_cast<Type>(i * 31 + addr * 7);
+            jobs[i].memory[addr] = val;
+            lanes[i / LANES].cell(addr, i % LANES) = val;
+        }
+    }
+
+    std::vector<typename BatchComputer<N, Type>::Result> results(INSTANCES);
+    double scalar = measure([&] {
+        batch.run(jobs.data(), INSTANCES, results.data(), 1);
+    });
+    double lockstep = measure([&] {
+        for (auto &group : lanes)
+            Lockstep::template run<tmpasm_bench>(group);
+    });
+    std::printf("%-8s scalar %8.3f s   lockstep %8.3f s   speedup %6.2fx\n",
+                name, scalar, lockstep, scalar / lockstep);
+
+    for (size_t i = 0; i < INSTANCES; ++i) {
+        for (size_t addr = 0; addr < N; ++addr) {
+            if (results[i].memory[addr] != lanes[i / LANES].cell(addr, i % LANES))
+                return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    bool same = bench<int8_t>("int8_t") && bench<int16_t>("int16_t") &&
+                bench<int32_t>("int32_t") && bench<int64_t>("int64_t");
+    return same ? 0 : 1;
+}
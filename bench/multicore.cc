@@ -0,0 +1,83 @@
+// Contended atomics on MulticoreComputer for 1, 2, 4, ... cores up to twice the number of
+// hardware threads: every core adds to one shared counter with Xadd, then takes a CmpXchg
+// spinlock around plain additions. Results are checked against the number of cores.
+#include "../src/multicore.h"
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+constexpr size_t ITERATIONS = 200000;
+constexpr size_t N = 2;
+using Type = int64_t;
+
+template<typename T, size_t cores>
+double measure(std::array<Type, N> &memory) {
+    auto start = std::chrono::steady_clock::now();
+    auto ans = MulticoreComputer<N, Type>::run<T, cores>(memory);
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    for (const auto &core : ans) {
+        if (core.error)
+            return -1;
+    }
+    return time.count();
+}
+
+// Adds 1 to the counter ITERATIONS times.
+using tmpasm_counter = Program<
+        D<Id("count"), Num<0>>,
+        Mov<Reg<2>, Num<ITERATIONS>>,
+        Label<Id("loop")>,
+        Mov<Reg<1>, Num<1>>,
+        Xadd<Mem<Lea<Id("count")>>, Reg<1>>,
+        Dec<Reg<2>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+// Adds 1 to the total ITERATIONS times, holding the lock.
+using tmpasm_locked = Program<
+        D<Id("lock"), Num<0>>,
+        D<Id("total"), Num<0>>,
+        Mov<Reg<2>, Num<ITERATIONS>>,
+        Label<Id("loop")>,
+        Mov<Reg<1>, Num<0>>,
+        CmpXchg<Mem<Lea<Id("lock")>>, Reg<1>, Num<1>>,
+        Jz<Id("locked")>,
+        Jmp<Id("loop")>,
+        Label<Id("locked")>,
+        Add<Mem<Lea<Id("total")>>, Num<1>>,
+        Mov<Reg<1>, Num<-1>>,
+        Xadd<Mem<Lea<Id("lock")>>, Reg<1>>,
+        Dec<Reg<2>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+template<size_t cores>
+bool bench() {
+    std::array<Type, N> memory{};
+    double counter = measure<tmpasm_counter, cores>(memory);
+    if (counter < 0 || memory[0] != static_cast<Type>(cores * ITERATIONS))
+        return false;
+    double locked = measure<tmpasm_locked, cores>(memory);
+    if (locked < 0 || memory[0] != 0 || memory[1] != static_cast<Type>(cores * ITERATIONS))
+        return false;
+
+    double adds = static_cast<double>(cores * ITERATIONS);
+    std::printf("%3zu cores  xadd %8.3f s %12.0f adds/s  lock %8.3f s %12.0f adds/s\n",
+                cores, counter, adds / counter, locked, adds / locked);
+    return true;
+}
+
+template<size_t... cores>
+int run(std::index_sequence<cores...>) {
+    unsigned max_cores = 2 * std::max(1u, std::thread::hardware_concurrency());
+    bool ok = true;
+    // Cores are template arguments, counts above max_cores are skipped.
+    ((ok = ok && ((size_t{1} << cores) > max_cores || bench<size_t{1} << cores>())), ...);
+    return ok ? 0 : 1;
+}
+
+int main() {
+    return run(std::make_index_sequence<8>());
+}
@@ -0,0 +1,53 @@
+// Compares run with TracingComputer::run, which writes every executed instruction to a trace.
+#include "../src/trace.h"
+#include <array>
+#include <chrono>
+#include <cstdio>
+
+constexpr uint64_t ITERATIONS = 10000000;
+// Executed instructions per loop iteration, labels excluded.
+constexpr uint64_t LOOP_SIZE = 7;
+
+using tmpasm_bench = Program<
+        D<Id("cnt"), Num<ITERATIONS>>,
+        D<Id("acc"), Num<0>>,
+        D<Id("ptr"), Num<8>>,
+        Label<Id("loop")>,
+        Add<Mem<Lea<Id("acc")>>, Mem<Lea<Id("cnt")>>>,
+        And<Mem<Lea<Id("acc")>>, Num<0xffff>>,
+        Mov<Mem<Mem<Lea<Id("ptr")>>>, Mem<Lea<Id("acc")>>>,
+        Cmp<Mem<Mem<Lea<Id("ptr")>>>, Num<0>>,
+        Dec<Mem<Lea<Id("cnt")>>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+constexpr size_t N = 16;
+using Type = int64_t;
+
+template<typename F>
+static double measure(const char *name, F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    std::printf("%-10s %8.3f s %10.1f M instructions/s\n", name, time.count(),
+                ITERATIONS * LOOP_SIZE / time.count() / 1e6);
+    return time.count();
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/tmpasm_bench.trace";
+
+    std::array<Type, N> untraced{};
+    double untraced_time = measure("untraced", [&] {
+        Computer<N, Type>::run<tmpasm_bench>(untraced);
+    });
+
+    std::array<Type, N> traced{};
+    double traced_time = measure("traced", [&] {
+        TracingComputer<N, Type>::run<tmpasm_bench>(traced, path);
+    });
+
+    std::printf("overhead   %8.2fx\n", traced_time / untraced_time);
+    return untraced == traced ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+#include "batch.h"
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+constexpr size_t N = 8;
+constexpr size_t JOBS = 20000;
+constexpr unsigned THREADS = 4;
+
+// Sums cells 2..7 into s.
+using tmpasm_sum = Program<
+        D<Id("s"), Num<0>>,
+        D<Id("i"), Num<2>>,
+        Label<Id("loop")>,
+        Add<Mem<Lea<Id("s")>>, Mem<Mem<Lea<Id("i")>>>>,
+        Inc<Mem<Lea<Id("i")>>>,
+        Cmp<Mem<Lea<Id("i")>>, Num<N>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+// Writes to the cell addressed by cell 2, fails when it is out of memory.
+using tmpasm_store = Program<
+        Mov<Mem<Mem<Num<2>>>, Num<1>>,
+        Inc<Mem<Num<3>>>>;
+
+// Fails with every memory.
+using tmpasm_fault = Program<
+        D<Id("p"), Num<100>>,
+        Mov<Mem<Mem<Lea<Id("p")>>>, Num<1>>>;
+
+template<typename Type>
+struct Expected {
+    std::array<Type, N> memory{};
+    const char *error = nullptr;
+};
+
+// Runs P at runtime like Computer::run, but on given memory.
+template<typename Type, typename P>
+Expected<Type> reference(const std::array<Type, N> &memory) {
+    Expected<Type> ans;
+    Env<Type, N> env;
+    env.memory = memory;
+    P::template load_variables<N, Type, 0>(env.memory.data());
+    try {
+        env = Computer<N, Type>::template boot<P>(env);
+    } catch (const char *message) {
+        ans.error = message;
+    }
+    ans.memory = env.memory;
+    return ans;
+}
+
+template<typename Type, typename P>
+Expected<Type> reference() {
+    Expected<Type> ans;
+    try {
+        Computer<N, Type>::template run<P>(ans.memory);
+    } catch (const char *message) {
+        ans.error = message;
+    }
+    return ans;
+}
+
+// Jobs with odd numbers have zeroed memory and are compared with Computer::run.
+template<typename Type>
+bool batch() {
+    using Batch = BatchComputer<N, Type>;
+    Batch computer;
+    size_t programs[] = {computer.template add_program<tmpasm_sum>(),
+                         computer.template add_program<tmpasm_store>(),
+                         computer.template add_program<tmpasm_fault>()};
+
+    std::vector<typename Batch::Job> jobs(JOBS);
+    std::vector<Expected<Type>> expected(JOBS);
+    for (size_t i = 0; i < JOBS; ++i) {
+        jobs[i].program = programs[i % 3];
+        if (i % 2 == 0) {
+            for (size_t addr = 0; addr < N; ++addr)
+                jobs[i].memory[addr] = static_cast<Type>(i * 7 + addr * 3 + i / 5 % 11);
+        }
+        const auto &memory = jobs[i].memory;
+        switch (i % 6) {
+            case 0: expected[i] = reference<Type, tmpasm_sum>(memory); break;
+            case 1: expected[i] = reference<Type, tmpasm_store>(); break;
+            case 2: expected[i] = reference<Type, tmpasm_fault>(memory); break;
+            case 3: expected[i] = reference<Type, tmpasm_sum>(); break;
+            case 4: expected[i] = reference<Type, tmpasm_store>(memory); break;
+            case 5: expected[i] = reference<Type, tmpasm_fault>(); break;
+        }
+    }
+
+    auto results = computer.run(jobs, THREADS);
+    for (size_t i = 0; i < JOBS; ++i) {
+        const char *error = results[i].error, *expected_error = expected[i].error;
+        bool same = error && expected_error ? std::strcmp(error, expected_error) == 0 :
+                    !error && !expected_error && results[i].memory == expected[i].memory;
+        if (!same) {
+            std::cerr << "Failed [batch job " << i << "]." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    bool ok = batch<int8_t>() & batch<uint16_t>() & batch<int32_t>() & batch<uint64_t>();
+    return ok ? 0 : 1;
+}
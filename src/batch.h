@@ -0,0 +1,186 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "computer.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Job indexes [begin, end) owned by a worker, packed to be changed by a single CAS.
+// Owner takes jobs from the beginning, thieves take the upper half. A non-empty range
+// never repeats (its first job is not taken yet), so there is no ABA problem.
+class alignas(64) JobRange {
+    std::atomic<uint64_t> range{0};
+
+    static constexpr uint64_t pack(uint64_t begin, uint64_t end) {
+        return begin << 32 | end;
+    }
+
+public:
+    // Only the owner sets its range, when it is empty.
+    void reset(size_t begin, size_t end) {
+        range.store(pack(begin, end), std::memory_order_release);
+    }
+
+    // Takes the first job, returns false if there is none.
+    bool pop(size_t &job) {
+        uint64_t old = range.load(std::memory_order_acquire);
+        for (;;) {
+            uint64_t begin = old >> 32, end = old & UINT32_MAX;
+            if (begin == end)
+                return false;
+            if (range.compare_exchange_weak(old, pack(begin + 1, end),
+                                            std::memory_order_acq_rel,
+                                            std::memory_order_acquire)) {
+                job = begin;
+                return true;
+            }
+        }
+    }
+
+    // Moves the upper half of jobs, at least one, to the empty range of thief.
+    bool steal(JobRange &thief) {
+        uint64_t old = range.load(std::memory_order_acquire);
+        for (;;) {
+            uint64_t begin = old >> 32, end = old & UINT32_MAX;
+            if (begin == end)
+                return false;
+            uint64_t middle = begin + (end - begin) / 2;
+            if (range.compare_exchange_weak(old, pack(begin, middle),
+                                            std::memory_order_acq_rel,
+                                            std::memory_order_acquire)) {
+                thief.reset(middle, end);
+                return true;
+            }
+        }
+    }
+};
+
+// Program prepared by BatchComputer. Code is a parameter, so that programs have the linkage
+// of the engine.
+template<size_t N, typename Type, typename Code = ThreadedCode<Type, N>>
+struct BatchProgram {
+    Code code;
+    std::vector<Instruction> declarations;
+};
+
+// Runs many independent (program, initial memory) jobs on a work-stealing pool of threads.
+// Programs are prepared once, results are the same as of Computer::run.
+template<size_t N, typename Type>
+class BatchComputer {
+    static_assert(std::is_integral<Type>::value, "Computer requires integral types.");
+    static_assert(!std::is_same<Type, bool>::value, "Bool does not have unsigned version");
+
+    std::vector<BatchProgram<N, Type>> programs;
+
+public:
+    struct Job {
+        // Index returned by add_program.
+        size_t program = 0;
+        // Memory before loading variables, instead of zeros.
+        std::array<Type, N> memory{};
+    };
+
+    struct Result {
+        std::array<Type, N> memory{};
+        // Error thrown by the program, nullptr if there was none.
+        const char *error = nullptr;
+    };
+
+    // Prepares the program for jobs, returns its index.
+    size_t add_program(const std::vector<Instruction> &code) {
+        std::vector<Instruction> declarations;
+        for (const Instruction &ins : code) {
+            if (ins.type == DECL)
+                declarations.push_back(ins);
+        }
+        programs.push_back({ThreadedCode<Type, N>(code.data(), code.size()),
+                              std::move(declarations)});
+        return programs.size() - 1;
+    }
+
+    template<typename T>
+    size_t add_program() {
+        T::template check_program<N, Type>();
+
+        static constexpr auto code = Bytecode<T>::decode();
+        return add_program(std::vector<Instruction>(code.begin(), code.end()));
+    }
+
+    // Runs count jobs, memory after jobs[i] is written to results[i].
+    // Uses all hardware threads if threads is 0, the calling thread is one of the workers.
+    void run(const Job *jobs, size_t count, Result *results, unsigned threads = 0) const {
+        if (count > UINT32_MAX)
+            throw "Too many jobs";
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = static_cast<unsigned>(
+                std::min<size_t>(threads, std::max<size_t>(count, 1)));
+
+        // Jobs are split evenly, then idle workers steal from busy ones.
+        std::vector<JobRange> ranges(threads);
+        for (unsigned i = 0; i < threads; ++i)
+            ranges[i].reset(count * i / threads, count * (i + 1) / threads);
+
+        std::vector<std::thread> workers;
+        workers.reserve(threads - 1);
+        for (unsigned i = 1; i < threads; ++i)
+            workers.emplace_back([&, i] { work(i, ranges, jobs, results); });
+        work(0, ranges, jobs, results);
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    std::vector<Result> run(const std::vector<Job> &jobs, unsigned threads = 0) const {
+        std::vector<Result> results(jobs.size());
+        run(jobs.data(), jobs.size(), results.data(), threads);
+        return results;
+    }
+
+private:
+    void execute(const Job &job, Result &result, Env<Type, N> &env) const {
+        result.error = nullptr;
+        if (job.program >= programs.size()) {
+            result.error = "Program not found";
+            return;
+        }
+        const BatchProgram<N, Type> &program = programs[job.program];
+        env.memory = job.memory;
+        env.flags = {};
+        try {
+            load_declarations<Type, N>(program.declarations.data(),
+                                       program.declarations.size(), env.memory.data());
+            program.code.execute(env.memory.data(), env.flags);
+        } catch (const char *message) {
+            result.error = message;
+        }
+        result.memory = env.memory;
+    }
+
+    // Executes own jobs, then steals. Stops when no worker has jobs left to steal.
+    void work(size_t id, std::vector<JobRange> &ranges, const Job *jobs,
+              Result *results) const {
+        // Arena is allocated by the worker, so its pages are local to the worker's core.
+        auto arena = std::make_unique<Env<Type, N>>();
+        for (;;) {
+            size_t job;
+            if (ranges[id].pop(job)) {
+                execute(jobs[job], results[job], *arena);
+                continue;
+            }
+            bool stolen = false;
+            for (size_t i = 1; i < ranges.size() && !stolen; ++i)
+                stolen = ranges[(id + i) % ranges.size()].steal(ranges[id]);
+            if (!stolen)
+                return;
+        }
+    }
+};
+
+#endif // BATCH_H
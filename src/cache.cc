@@ -0,0 +1,74 @@
+#include "cache.h"
+#include <array>
+#include <cstring>
+#include <iostream>
+
+constexpr size_t N = 4;
+
+// Sums 0..99.
+using tmpasm_sum = Program<
+        D<Id("i"), Num<0>>,
+        D<Id("s"), Num<0>>,
+        Label<Id("loop")>,
+        Add<Mem<Lea<Id("s")>>, Mem<Lea<Id("i")>>>,
+        Inc<Mem<Lea<Id("i")>>>,
+        Cmp<Mem<Lea<Id("i")>>, Num<100>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+// Same as tmpasm_sum with other names of variables and labels.
+using tmpasm_renamed = Program<
+        D<Id("k"), Num<0>>,
+        D<Id("total"), Num<0>>,
+        Label<Id("again")>,
+        Add<Mem<Lea<Id("total")>>, Mem<Lea<Id("k")>>>,
+        Inc<Mem<Lea<Id("k")>>>,
+        Cmp<Mem<Lea<Id("k")>>, Num<100>>,
+        Jz<Id("stop")>,
+        Jmp<Id("again")>,
+        Label<Id("stop")>>;
+
+// Sums 0..98.
+using tmpasm_shorter = Program<
+        D<Id("i"), Num<0>>,
+        D<Id("s"), Num<0>>,
+        Label<Id("loop")>,
+        Add<Mem<Lea<Id("s")>>, Mem<Lea<Id("i")>>>,
+        Inc<Mem<Lea<Id("i")>>>,
+        Cmp<Mem<Lea<Id("i")>>, Num<99>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+template<typename P, size_t memSize = N, typename memType = int, size_t steps = SIZE_MAX>
+constexpr uint64_t key = boot_key<P, memSize, memType, steps>();
+
+static_assert(key<tmpasm_sum> == key<tmpasm_renamed>, "Failed [boot_key renamed].");
+static_assert(key<tmpasm_sum> != key<tmpasm_shorter>, "Failed [boot_key constant].");
+static_assert(key<tmpasm_sum> != key<tmpasm_sum, N + 1>, "Failed [boot_key N].");
+static_assert(key<tmpasm_sum> != key<tmpasm_sum, N, unsigned>, "Failed [boot_key type].");
+static_assert(key<tmpasm_sum> != key<tmpasm_sum, N, int, 1000>, "Failed [boot_key steps].");
+
+// CachedComputer gives the memory of boot, taken from the cache header when hit.
+template<typename Type, typename P, size_t steps = SIZE_MAX>
+bool cached(const char *name, bool hit) {
+    constexpr auto expected = Computer<N, Type>::template boot<P, steps>();
+    constexpr auto memory = CachedComputer<N, Type>::template boot<P, steps>();
+    if (memory == expected && BootCache<key<P, N, Type, steps>>::hit == hit)
+        return true;
+    std::cerr << "Failed [" << name << (hit ? " hit" : " miss") << "]." << std::endl;
+    return false;
+}
+
+// With --hit, every boot has to be taken from the cache header, e.g. one written by an earlier
+// build of this file with TMPASM_BOOT_CACHE_WRITE.
+int main(int argc, char **argv) {
+    bool hit = argc > 1 && std::strcmp(argv[1], "--hit") == 0;
+    bool ok = cached<int, tmpasm_sum>("tmpasm_sum", hit) &
+              cached<int, tmpasm_renamed>("tmpasm_renamed", hit) &
+              cached<int, tmpasm_shorter>("tmpasm_shorter", hit) &
+              cached<uint8_t, tmpasm_sum>("tmpasm_sum", hit) &
+              cached<int, tmpasm_sum, 1000>("tmpasm_sum", hit);
+    return ok ? 0 : 1;
+}
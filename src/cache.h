@@ -0,0 +1,173 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "computer.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#ifdef TMPASM_BOOT_CACHE_WRITE
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#endif
+
+// Result of boot kept in the cache header, specialized for keys of boot_key as
+//     template<> struct BootCache<key> {
+//         static constexpr bool hit = true;
+//         static constexpr uint64_t memory[] = {cells converted to uint64_t};
+//     };
+template<uint64_t key>
+struct BootCache {
+    static constexpr bool hit = false;
+};
+
+// Cache header, written by programs built with TMPASM_BOOT_CACHE_WRITE set to its path.
+#ifndef TMPASM_BOOT_CACHE
+#define TMPASM_BOOT_CACHE "tmpasm_boot_cache.h"
+#endif
+#if __has_include(TMPASM_BOOT_CACHE)
+#include TMPASM_BOOT_CACHE
+#endif
+
+namespace {
+    // Changes when decoded instructions change, so older entries are not used.
+    constexpr uint64_t BOOT_CACHE_VERSION = 1;
+
+    constexpr uint64_t hash_word(uint64_t hash, uint64_t val) {
+        return mix(hash ^ (val + 0x9E3779B97F4A7C15 + (hash << 6) + (hash >> 2)));
+    }
+
+    constexpr uint64_t hash_operand(uint64_t hash, const Operand &op) {
+        hash = hash_word(hash, op.kind);
+        hash = hash_word(hash, op.value);
+        hash = hash_word(hash, op.negative);
+        return hash_word(hash, op.depth);
+    }
+
+    // Hash of what the result of boot depends on: decoded instructions (with values of
+    // declarations, labels are resolved), memory size, word type and the step budget. Names
+    // of variables and labels do not change it, jumps are hashed without Ids of their labels.
+    template<typename T, size_t memSize, typename memType, size_t steps>
+    constexpr uint64_t boot_key() {
+        constexpr auto code = Bytecode<T>::decode();
+        uint64_t hash = hash_word(BOOT_CACHE_VERSION, memSize);
+        hash = hash_word(hash, sizeof(memType));
+        hash = hash_word(hash, std::is_signed<memType>::value);
+        hash = hash_word(hash, steps);
+        hash = hash_word(hash, code.size());
+        for (const Instruction &ins : code) {
+            bool jump = ins.type == JMP || ins.type == JZ || ins.type == JS;
+            hash = hash_word(hash, ins.type);
+            hash = hash_operand(hash, jump ? Operand{} : ins.arg1);
+            hash = hash_operand(hash, ins.arg2);
+            hash = hash_operand(hash, ins.arg3);
+            hash = hash_word(hash, ins.target);
+        }
+        return hash;
+    }
+
+#ifdef TMPASM_BOOT_CACHE_WRITE
+    // Entries of results booted by the program, merged with the cache header when it exits.
+    // Every translation unit keeps its own entries, they are merged one after another.
+    class BootCacheWriter {
+        std::map<uint64_t, std::string> entries;
+
+        static constexpr const char PREFIX[] = "template<> struct BootCache<";
+
+    public:
+        ~BootCacheWriter() {
+            if (entries.empty())
+                return;
+            std::ifstream in(TMPASM_BOOT_CACHE_WRITE);
+            for (std::string line; std::getline(in, line);) {
+                if (line.compare(0, sizeof(PREFIX) - 1, PREFIX) == 0) {
+                    uint64_t key = std::stoull(line.substr(sizeof(PREFIX) - 1), nullptr, 16);
+                    entries.emplace(key, line);
+                }
+            }
+            in.close();
+
+            std::FILE *file = std::fopen(TMPASM_BOOT_CACHE_WRITE, "w");
+            if (!file)
+                return;
+            std::fputs("// Results of Computer::boot, written by programs built with "
+                       "TMPASM_BOOT_CACHE_WRITE.\n"
+                       "#ifndef TMPASM_BOOT_CACHE_H\n#define TMPASM_BOOT_CACHE_H\n", file);
+            for (const auto &entry : entries)
+                std::fprintf(file, "%s\n", entry.second.c_str());
+            std::fputs("#endif // TMPASM_BOOT_CACHE_H\n", file);
+            std::fclose(file);
+        }
+
+        template<typename memType, size_t memSize>
+        bool add(uint64_t key, const std::array<memType, memSize> &memory) {
+            char number[32];
+            std::snprintf(number, sizeof(number), "0x%016" PRIx64 "ULL", key);
+            std::string line = PREFIX + std::string(number) +
+                               "> { static constexpr bool hit = true; "
+                               "static constexpr uint64_t memory[] = {";
+            for (size_t addr = 0; addr < memSize; ++addr) {
+                std::snprintf(number, sizeof(number), "%s%" PRIu64 "ULL", addr ? ", " : "",
+                              static_cast<uint64_t>(memory[addr]));
+                line += number;
+            }
+            entries[key] = line + "}; };";
+            return true;
+        }
+    };
+
+    BootCacheWriter &boot_cache_writer() {
+        static BootCacheWriter writer;
+        return writer;
+    }
+#endif
+} // anonymous namespace
+
+// Computer whose boot takes the result from the cache header when the program, memory size,
+// word type and step budget are the same as when it was written, instead of running the
+// program during compilation again. Programs built with TMPASM_BOOT_CACHE_WRITE set to the
+// path of the header write results of their boot calls to it when they exit.
+template<size_t N, typename Type>
+struct CachedComputer {
+    static_assert(std::is_integral<Type>::value, "Computer requires integral types.");
+    static_assert(!std::is_same<Type, bool>::value, "Bool does not have unsigned version");
+
+    template<typename T, size_t steps = SIZE_MAX>
+    static constexpr std::array<Type, N> boot() {
+#ifdef TMPASM_BOOT_CACHE_WRITE
+        static_cast<void>(&Entry<T, steps>::written);
+#endif
+        return Entry<T, steps>::memory;
+    }
+
+private:
+    template<uint64_t key, typename T, size_t steps>
+    static constexpr std::array<Type, N> load() {
+        if constexpr (BootCache<key>::hit) {
+            static_assert(sizeof(BootCache<key>::memory) == N * sizeof(uint64_t),
+                          "Corrupted boot cache");
+            T::template check_program<N, Type>();
+            std::array<Type, N> memory{};
+            for (size_t addr = 0; addr < N; ++addr)
+                memory[addr] = static_cast<Type>(BootCache<key>::memory[addr]);
+            return memory;
+        } else {
+            return Computer<N, Type>::template boot<T, steps>();
+        }
+    }
+
+    template<typename T, size_t steps>
+    struct Entry {
+        static constexpr uint64_t key = boot_key<T, N, Type, steps>();
+        static constexpr std::array<Type, N> memory = load<key, T, steps>();
+#ifdef TMPASM_BOOT_CACHE_WRITE
+        static inline const bool written = boot_cache_writer().add(key, memory);
+#endif
+    };
+};
+
+#endif // CACHE_H
@@ -1,6 +1,17 @@
 #include "computer.h"
+#include "parser.h"
+#include "ports.h"
+#include "trace.h"
+#if defined(__x86_64__) && defined(__linux__)
+#include "jit.h"
+#define TMPASM_TEST_JIT 1
+#endif
 #include <array>
+#include <cstdio>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 // Operator == dla std::array jest constexpr dopiero od C++20.
 template<class T, std::size_t N>
@@ -12,18 +23,24 @@ constexpr bool compare(std::array<T, N> const& arg1, std::array<T, N> const& arg
 
 using tmpasm_move = Program<
         Mov<Mem<Num<0>>, Num<42>>>;
+constexpr const char *tmpasm_move_source =
+        "mov [0], 42\n";
 
 using tmpasm_jump = Program<
         Inc<Mem<Num<0>>>,
         Jmp<Id("stop")>,
         Inc<Mem<Num<0>>>,
         Label<Id("stop")>>;
+constexpr const char *tmpasm_jump_source =
+        "inc [0]\njmp stop\ninc [0]\nstop:\n";
 
 using tmpasm_data = Program<
         Inc<Mem<Lea<Id("a")>>>,
         D<Id("a"), Num<0>>,
         D<Id("b"), Num<2>>,
         D<Id("c"), Num<3>>>;
+constexpr const char *tmpasm_data_source =
+        "inc [a]\nD a 0\nD b 2\nD c 3\n";
 
 using tmpasm_operations = Program<
         D<Id("a"), Num<4>>,
@@ -34,6 +51,8 @@ using tmpasm_operations = Program<
         Sub<Mem<Lea<Id("b")>>, Mem<Lea<Id("d")>>>,
         Mov<Mem<Lea<Id("c")>>, Num<0>>,
         Mov<Mem<Lea<Id("d")>>, Num<0>>>;
+constexpr const char *tmpasm_operations_source =
+        "D a 4\nD b 3\nD c 2\nD d 1\nadd [a], [c]\nsub [b], [d]\nmov [c], 0\nmov [d], 0\n";
 
 using tmpasm_helloworld = Program<
         Mov<Mem<Mem<Num<10>>>, Num<'h'>>,
@@ -57,12 +76,522 @@ using tmpasm_helloworld = Program<
         Mov<Mem<Mem<Num<10>>>, Num<'l'>>,
         Inc<Mem<Num<10>>>,
         Mov<Mem<Mem<Num<10>>>, Num<'d'>>>;
+constexpr const char *tmpasm_helloworld_source =
+        "mov [[10]], 'h'\ninc [10]\nmov [[10]], 'e'\ninc [10]\nmov [[10]], 'l'\ninc [10]\n"
+        "mov [[10]], 'l'\ninc [10]\nmov [[10]], 'o'\ninc [10]\nmov [[10]], ' '\ninc [10]\n"
+        "mov [[10]], 'w'\ninc [10]\nmov [[10]], 'o'\ninc [10]\nmov [[10]], 'r'\ninc [10]\n"
+        "mov [[10]], 'l'\ninc [10]\nmov [[10]], 'd'\n";
+
+// Dec of 0 sets SF only for signed types.
+using tmpasm_sign = Program<
+        D<Id("a"), Num<0>>,
+        D<Id("b"), Num<0>>,
+        Dec<Mem<Lea<Id("a")>>>,
+        Js<Id("neg")>,
+        Mov<Mem<Lea<Id("b")>>, Num<1>>,
+        Jmp<Id("end")>,
+        Label<Id("neg")>,
+        Mov<Mem<Lea<Id("b")>>, Num<2>>,
+        Label<Id("end")>>;
+constexpr const char *tmpasm_sign_source =
+        "D a 0\nD b 0\ndec [a]\njs neg\nmov [b], 1\njmp end\nneg:\nmov [b], 2\nend:\n";
+
+// Inc of 127 wraps for int8_t, Not changes only ZF. Mov and Jmp keep flags.
+using tmpasm_flags = Program<
+        D<Id("a"), Num<127>>,
+        D<Id("b"), Num<-1>>,
+        D<Id("z"), Num<0>>,
+        D<Id("s"), Num<0>>,
+        Inc<Mem<Lea<Id("a")>>>,
+        Not<Mem<Lea<Id("b")>>>,
+        Js<Id("sign")>,
+        Jmp<Id("zf")>,
+        Label<Id("sign")>,
+        Mov<Mem<Lea<Id("s")>>, Num<1>>,
+        Label<Id("zf")>,
+        Jz<Id("zero")>,
+        Jmp<Id("end")>,
+        Label<Id("zero")>,
+        Mov<Mem<Lea<Id("z")>>, Num<1>>,
+        Label<Id("end")>>;
+constexpr const char *tmpasm_flags_source =
+        "D a 127\nD b -1\nD z 0\nD s 0\ninc [a]\nnot [b]\njs sign\njmp zf\n"
+        "sign:\nmov [s], 1\nzf:\njz zero\njmp end\nzero:\nmov [z], 1\nend:\n";
+
+// Follows chains of addresses 0 -> 1 -> 2 and 1 -> 2.
+using tmpasm_indirect = Program<
+        D<Id("p"), Num<1>>,
+        D<Id("q"), Num<2>>,
+        D<Id("r"), Num<0>>,
+        Mov<Mem<Mem<Mem<Num<0>>>>, Num<7>>,
+        Add<Mem<Lea<Id("p")>>, Mem<Mem<Lea<Id("q")>>>>>;
+constexpr const char *tmpasm_indirect_source =
+        "D p 1\nD q 2\nD r 0\nmov [[[0]]], 7\nadd [p], [[q]]\n";
+
+// Lea and jumps use the first of duplicate declarations and labels.
+using tmpasm_duplicates = Program<
+        D<Id("a"), Num<1>>,
+        D<Id("a"), Num<2>>,
+        Jmp<Id("l")>,
+        Label<Id("l")>,
+        Inc<Mem<Lea<Id("a")>>>,
+        Label<Id("l")>,
+        Inc<Mem<Lea<Id("a")>>>>;
+constexpr const char *tmpasm_duplicates_source =
+        "D a 1\nD a 2\njmp l\nl:\ninc [a]\nl:\ninc [a]\n";
+
+// Sums 0..4999, loops do not grow the call depth of boot.
+using tmpasm_loop = Program<
+        D<Id("i"), Num<0>>,
+        D<Id("s"), Num<0>>,
+        Label<Id("loop")>,
+        Add<Mem<Lea<Id("s")>>, Mem<Lea<Id("i")>>>,
+        Inc<Mem<Lea<Id("i")>>>,
+        Cmp<Mem<Lea<Id("i")>>, Num<5000>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+constexpr const char *tmpasm_loop_source =
+        "D i 0\nD s 0\nloop:\nadd [s], [i]\ninc [i]\ncmp [i], 5000\njz end\njmp loop\nend:\n";
+
+// Fused additions, an overwritten Mov, a dead Cmp and flags read after a label.
+using tmpasm_peephole = Program<
+        D<Id("a"), Num<0>>,
+        D<Id("b"), Num<0>>,
+        D<Id("z"), Num<0>>,
+        D<Id("s"), Num<0>>,
+        Inc<Mem<Lea<Id("a")>>>,
+        Inc<Mem<Lea<Id("a")>>>,
+        Add<Mem<Lea<Id("a")>>, Num<3>>,
+        Sub<Mem<Lea<Id("a")>>, Num<1>>,
+        Mov<Mem<Lea<Id("b")>>, Num<1>>,
+        Mov<Mem<Lea<Id("b")>>, Mem<Lea<Id("a")>>>,
+        Cmp<Mem<Lea<Id("a")>>, Num<0>>,
+        Sub<Mem<Lea<Id("b")>>, Num<4>>,
+        Label<Id("check")>,
+        Jz<Id("zero")>,
+        Jmp<Id("sign")>,
+        Label<Id("zero")>,
+        Mov<Mem<Lea<Id("z")>>, Num<1>>,
+        Label<Id("sign")>,
+        Dec<Mem<Lea<Id("s")>>>,
+        Js<Id("neg")>,
+        Jmp<Id("end")>,
+        Label<Id("neg")>,
+        Add<Mem<Lea<Id("s")>>, Num<10>>,
+        Label<Id("end")>>;
+constexpr const char *tmpasm_peephole_source =
+        "D a 0\nD b 0\nD z 0\nD s 0\ninc [a]\ninc [a]\nadd [a], 3\nsub [a], 1\nmov [b], 1\n"
+        "mov [b], [a]\ncmp [a], 0\nsub [b], 4\ncheck:\njz zero\njmp sign\nzero:\nmov [z], 1\n"
+        "sign:\ndec [s]\njs neg\njmp end\nneg:\nadd [s], 10\nend:\n";
+
+// Counted loop evaluated at once by boot, flags after it are those of the last Dec.
+using tmpasm_counted = Program<
+        D<Id("c"), Num<1000000>>,
+        D<Id("x"), Num<0>>,
+        D<Id("k"), Num<7>>,
+        D<Id("y"), Num<0>>,
+        D<Id("z"), Num<0>>,
+        Label<Id("loop")>,
+        Add<Mem<Lea<Id("x")>>, Num<3>>,
+        Add<Mem<Lea<Id("y")>>, Mem<Lea<Id("k")>>>,
+        Dec<Mem<Lea<Id("c")>>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>,
+        Js<Id("neg")>,
+        Jz<Id("zero")>,
+        Jmp<Id("done")>,
+        Label<Id("neg")>,
+        Mov<Mem<Lea<Id("z")>>, Num<2>>,
+        Jmp<Id("done")>,
+        Label<Id("zero")>,
+        Mov<Mem<Lea<Id("z")>>, Num<1>>,
+        Label<Id("done")>>;
+constexpr const char *tmpasm_counted_source =
+        "D c 1000000\nD x 0\nD k 7\nD y 0\nD z 0\nloop:\nadd [x], 3\nadd [y], [k]\ndec [c]\n"
+        "jz end\njmp loop\nend:\njs neg\njz zero\njmp done\nneg:\nmov [z], 2\njmp done\n"
+        "zero:\nmov [z], 1\ndone:\n";
+
+// Hlt ends the program before the second Inc.
+using tmpasm_halt = Program<
+        Inc<Mem<Num<0>>>,
+        Hlt,
+        Inc<Mem<Num<0>>>>;
+constexpr const char *tmpasm_halt_source =
+        "inc [0]\nhlt\ninc [0]\n";
+
+// Never halts, memory repeats every 4 jumps.
+using tmpasm_spin = Program<
+        D<Id("a"), Num<0>>,
+        Label<Id("spin")>,
+        Inc<Mem<Lea<Id("a")>>>,
+        And<Mem<Lea<Id("a")>>, Num<3>>,
+        Jmp<Id("spin")>>;
+
+// Ret of g continues in f, then Ret of f after the first Call.
+using tmpasm_nested = Program<
+        D<Id("x"), Num<0>>,
+        Call<Id("f")>,
+        Jmp<Id("end")>,
+        Label<Id("f")>,
+        Call<Id("g")>,
+        Inc<Mem<Lea<Id("x")>>>,
+        Ret,
+        Label<Id("g")>,
+        Add<Mem<Lea<Id("x")>>, Num<10>>,
+        Ret,
+        Label<Id("end")>>;
+constexpr const char *tmpasm_nested_source =
+        "D x 0\ncall f\njmp end\nf:\ncall g\ninc [x]\nret\ng:\nadd [x], 10\nret\nend:\n";
+
+// The second call of sq has another a, the third takes the result of the first from the
+// cache. Cells and flags are set as they were at the first call, all are inputs.
+using tmpasm_memo = Program<
+        D<Id("a"), Num<3>>,
+        D<Id("r"), Num<0>>,
+        Call<Id("sq"), Lea<Id("a")>, Num<2>>,
+        Inc<Mem<Lea<Id("a")>>>,
+        Mov<Mem<Lea<Id("r")>>, Num<0>>,
+        Cmp<Num<1>, Num<0>>,
+        Call<Id("sq"), Lea<Id("a")>, Num<2>>,
+        Dec<Mem<Lea<Id("a")>>>,
+        Mov<Mem<Lea<Id("r")>>, Num<0>>,
+        Cmp<Num<1>, Num<0>>,
+        Call<Id("sq"), Lea<Id("a")>, Num<2>>,
+        Jmp<Id("end")>,
+        Label<Id("sq")>,
+        Mov<Mem<Lea<Id("r")>>, Mem<Lea<Id("a")>>>,
+        Add<Mem<Lea<Id("r")>>, Mem<Lea<Id("a")>>>,
+        Ret,
+        Label<Id("end")>>;
+constexpr const char *tmpasm_memo_source =
+        "D a 3\nD r 0\ncall sq, a, 2\ninc [a]\nmov [r], 0\ncmp 1, 0\ncall sq, a, 2\n"
+        "dec [a]\nmov [r], 0\ncmp 1, 0\ncall sq, a, 2\njmp end\n"
+        "sq:\nmov [r], [a]\nadd [r], [a]\nret\nend:\n";
+
+// Ret without a Call.
+using tmpasm_return = Program<
+        Inc<Mem<Num<0>>>,
+        Ret>;
+
+// Copies overlapping blocks both ways, blocks of length 0 (read from cell 6) do nothing.
+// Cell 9 is set if CmpRange of (8, 8) and (8, 9) sets SF, cell 8 if CmpRange of length 0
+// sets ZF.
+using tmpasm_blocks = Program<
+        Fill<Mem<Num<1>>, Num<5>, Num<7>>,
+        Inc<Mem<Num<2>>>,
+        Add<Mem<Num<3>>, Num<2>>,
+        Add<Mem<Num<4>>, Num<3>>,
+        Copy<Mem<Num<2>>, Mem<Num<1>>, Num<3>>,
+        Copy<Mem<Num<0>>, Mem<Num<1>>, Num<3>>,
+        Fill<Mem<Num<7>>, Num<0>, Num<1>>,
+        Copy<Mem<Num<7>>, Mem<Num<0>>, Mem<Num<6>>>,
+        CmpRange<Mem<Num<2>>, Mem<Num<3>>, Num<2>>,
+        Js<Id("less")>,
+        Jmp<Id("eq")>,
+        Label<Id("less")>,
+        Inc<Mem<Num<9>>>,
+        Label<Id("eq")>,
+        CmpRange<Mem<Num<0>>, Mem<Num<3>>, Mem<Num<6>>>,
+        Jz<Id("zero")>,
+        Jmp<Id("end")>,
+        Label<Id("zero")>,
+        Inc<Mem<Num<8>>>,
+        Label<Id("end")>>;
+constexpr const char *tmpasm_blocks_source =
+        "fill [1], 5, 7\ninc [2]\nadd [3], 2\nadd [4], 3\ncopy [2], [1], 3\ncopy [0], [1], 3\n"
+        "fill [7], 0, 1\ncopy [7], [0], [6]\ncmprange [2], [3], 2\njs less\njmp eq\nless:\n"
+        "inc [9]\neq:\ncmprange [0], [3], [6]\njz zero\njmp end\nzero:\ninc [8]\nend:\n";
+
+// The block of 7 cells from cell 6 ends out of memory.
+using tmpasm_overrun = Program<
+        Mov<Mem<Num<0>>, Num<7>>,
+        Copy<Mem<Num<6>>, Mem<Num<0>>, Mem<Num<0>>>>;
+
+// There are REGISTERS registers, Reg<REGISTERS> is also rejected by Reg::check_lvalue.
+using tmpasm_register = Program<
+        Inc<Reg<REGISTERS>>>;
+
+// Cell 4 is out of memory of 4 cells, 300 out of uint8_t, also in unexecuted code.
+using tmpasm_far = Program<
+        Mov<Mem<Num<4>>, Num<1>>>;
+
+using tmpasm_wide = Program<
+        Jmp<Id("end")>,
+        Inc<Mem<Num<300>>>,
+        Label<Id("end")>>;
+
+// Registers are not memory: writes to register 0 leave cell 0 unchanged.
+using tmpasm_registers = Program<
+        Mov<Reg<0>, Num<2>>,
+        Mov<Reg<1>, Num<5>>,
+        Add<Reg<1>, Reg<0>>,
+        Mov<Mem<Reg<0>>, Reg<1>>,
+        Inc<Reg<0>>,
+        Mov<Mem<Num<1>>, Reg<0>>>;
+constexpr const char *tmpasm_registers_source =
+        "mov reg 0, 2\nmov reg 1, 5\nadd reg 1, reg 0\nmov [reg 0], reg 1\ninc reg 0\n"
+        "mov [1], reg 0\n";
+
+// Inc of 127 overflows int8_t, Inc of -1 wraps unsigned types to 0, Cmp of 0 and 1 is
+// negative.
+using tmpasm_wrap = Program<
+        D<Id("a"), Num<127>>,
+        D<Id("b"), Num<-1>>,
+        Inc<Mem<Lea<Id("a")>>>,
+        Inc<Mem<Lea<Id("b")>>>,
+        Cmp<Mem<Lea<Id("b")>>, Num<1>>>;
+constexpr const char *tmpasm_wrap_source =
+        "D a 127\nD b -1\ninc [a]\ninc [b]\ncmp [b], 1\n";
+
+// Writes doubled values of port 0 to port 1 until its end, then their count. In past the end
+// reads 0 again.
+using tmpasm_echo = Program<
+        D<Id("n"), Num<0>>,
+        D<Id("v"), Num<0>>,
+        Label<Id("loop")>,
+        In<Mem<Lea<Id("v")>>, Num<0>>,
+        Jz<Id("end")>,
+        Add<Mem<Lea<Id("v")>>, Mem<Lea<Id("v")>>>,
+        Out<Num<1>, Mem<Lea<Id("v")>>>,
+        Inc<Mem<Lea<Id("n")>>>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>,
+        In<Mem<Lea<Id("v")>>, Num<0>>,
+        Out<Num<1>, Mem<Lea<Id("n")>>>>;
+
+// Three declarations do not fit in two cells.
+using tmpasm_crowded = Program<
+        D<Id("a"), Num<1>>,
+        D<Id("b"), Num<2>>,
+        D<Id("c"), Num<3>>>;
+
+// Returns true if boot evaluates a loop of the program at once.
+template<size_t N, typename Type, typename P>
+constexpr bool folded() {
+    auto code = fold_loops<Type, N>(optimize<Type, N>(Bytecode<P>::decode()));
+    for (size_t i = 0; i < code.length; ++i)
+        if (code.code[i].type == LOOP) return true;
+    return false;
+}
+
+// Counts of profile for tmpasm_loop: the body runs 5000 times, the last Jz is taken.
+template<typename Type>
+constexpr bool profiled_loop() {
+    constexpr auto profile = Computer<2, Type>::template profile<tmpasm_loop>();
+    constexpr std::array<size_t, 9> counts = {1, 1, 5000, 5000, 5000, 5000, 5000, 4999, 1};
+    return compare(profile.counts, counts) && profile.taken[6] == 1 &&
+           profile.not_taken[6] == 4999 && profile.steps == 5000 * 4 + 4999 &&
+           profile.hottest_label == Id("loop") && profile.hottest_label_index == 2;
+}
+
+// Stop and label of boot with a budget of steps, hashing states from the start with watch.
+template<size_t N, typename Type, typename P, size_t steps, bool watch = false>
+constexpr bool stops(Stop stop, uint64_t label) {
+    constexpr auto outcome = watched_boot<Type, N, P, steps, watch>(nullptr, 0);
+    return outcome.stop == stop && outcome.label == label;
+}
+
+// Resuming tmpasm_loop every chunk steps gives the same memory as one boot, after as many
+// steps as boot<tmpasm_loop, steps> needs.
+template<typename Type>
+constexpr bool resumed_loop(size_t chunk) {
+    auto env = Computer<2, Type>::template initial<tmpasm_loop>();
+    size_t steps = 0;
+    for (; !Computer<2, Type>::template finished<tmpasm_loop>(env); steps += chunk)
+        env = Computer<2, Type>::template boot<tmpasm_loop>(env, chunk);
+    return compare(env.memory, Computer<2, Type>::template boot<tmpasm_loop>()) &&
+           steps >= 24999 && steps < 24999 + chunk;
+}
+
+// ZF and SF of tmpasm_wrap after steps instructions.
+template<typename Type>
+constexpr bool wrap_flags(size_t steps, bool ZF, bool SF) {
+    auto env = Computer<2, Type>::template boot<tmpasm_wrap>(
+            Computer<2, Type>::template initial<tmpasm_wrap>(), steps);
+    return env.flags.ZF() == ZF && env.flags.SF() == SF;
+}
+
+// Output of tmpasm_echo for values 5, 0, -3 and 7, connected to arrays during compilation.
+template<typename Type>
+constexpr bool echoed() {
+    const Type values[] = {5, 0, static_cast<Type>(-3), 7};
+    Type output[5]{}, expected[] = {10, 0, static_cast<Type>(-6), 14, 4};
+    Ports<Type> ports;
+    ports.input(0, values, 4);
+    ports.output(1, output, 5);
+    auto env = Computer<2, Type>::template boot<tmpasm_echo>(
+            Computer<2, Type>::template initial<tmpasm_echo>(), ports);
+    for (size_t i = 0; i < 5; ++i)
+        if (output[i] != expected[i]) return false;
+    return env.memory[0] == 4 && env.memory[1] == 0;
+}
+
+// Runs the program at runtime, as optimized, as decoded instructions and parsed from source
+// (and compiled by the JIT where it is available), memory has to be the same as after boot.
+template<size_t N, typename Type, typename P>
+bool matches_boot(const char *name, const char *source) {
+    constexpr auto expected = Computer<N, Type>::template boot<P>();
+    constexpr auto code = Bytecode<P>::decode();
+    std::array<Type, N> run{}, decoded{}, parsed{}, jit = expected;
+    Computer<N, Type>::template run<P>(run);
+    Computer<N, Type>::run(std::vector<Instruction>(code.begin(), code.end()), decoded);
+    std::istringstream in(source);
+    Computer<N, Type>::run(parse_program(in), parsed);
+#if TMPASM_TEST_JIT
+    JitComputer<N, Type>::template run<P>(jit);
+#endif
+    if (compare(run, expected) && compare(decoded, expected) && compare(parsed, expected) &&
+        compare(jit, expected))
+        return true;
+    std::cerr << "Failed [" << name << "] at runtime." << std::endl;
+    return false;
+}
+
+// Parsing source fails with message at line.
+bool parse_fails(const char *source, const char *message, size_t line) {
+    std::istringstream in(source);
+    try {
+        parse_program(in);
+    } catch (const ParseError &e) {
+        if (e.line == line && std::string(e.what()).find(message) != std::string::npos)
+            return true;
+    }
+    std::cerr << "Failed [parse " << message << "]." << std::endl;
+    return false;
+}
+
+// Running decoded instructions at runtime fails with message.
+template<size_t N, typename Type, typename P>
+bool run_fails(const char *name, const char *message) {
+    constexpr auto code = Bytecode<P>::decode();
+    std::array<Type, N> memory{};
+    try {
+        Computer<N, Type>::run(std::vector<Instruction>(code.begin(), code.end()), memory);
+    } catch (const char *e) {
+        if (std::string(e) == message)
+            return true;
+    }
+    std::cerr << "Failed [" << name << " " << message << "]." << std::endl;
+    return false;
+}
+
+// Checking constant addresses of P, which check_program does during compilation, fails with
+// message.
+template<size_t N, typename Type, typename P>
+bool rejected(const char *name, const char *message) {
+    constexpr auto code = Bytecode<P>::decode();
+    try {
+        check_addresses<Type, N>(code.data(), code.size());
+    } catch (const char *e) {
+        if (std::string(e) == message)
+            return true;
+    }
+    std::cerr << "Failed [" << name << " " << message << "]." << std::endl;
+    return false;
+}
+
+// Runs tmpasm_echo on count values streamed from a file, which ends with a part of a word,
+// to an output file.
+template<typename Type>
+bool echoes(size_t count) {
+    const char *in_path = "tmpasm_echo.in", *out_path = "tmpasm_echo.out";
+    std::vector<Type> values(count), expected;
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = static_cast<Type>(i * 37 - 1000);
+        expected.push_back(static_cast<Type>(values[i] * 2));
+    }
+    expected.push_back(static_cast<Type>(count));
+    std::FILE *in = std::fopen(in_path, "wb");
+    std::fwrite(values.data(), sizeof(Type), count, in);
+    std::fwrite("abcdefg", 1, sizeof(Type) - 1, in);
+    std::fclose(in);
+
+    std::array<Type, 2> memory{};
+    {
+        MappedInput<Type> input(in_path);
+        BufferedOutput<Type> output(out_path);
+        Ports<Type> ports;
+        ports.input(0, input);
+        ports.output(1, output);
+        Computer<2, Type>::template run<tmpasm_echo>(memory, ports);
+    }
+    std::vector<Type> written(count + 2);
+    std::FILE *out = std::fopen(out_path, "rb");
+    written.resize(std::fread(written.data(), sizeof(Type), written.size(), out));
+    std::fclose(out);
+    std::remove(in_path);
+    std::remove(out_path);
+    if (written == expected && memory[0] == static_cast<Type>(count) && memory[1] == 0)
+        return true;
+    std::cerr << "Failed [tmpasm_echo " << count << " values]." << std::endl;
+    return false;
+}
+
+// Reads the trace of P run from decoded instructions, every step has to match the next
+// instruction of boot(env, 1): its pc, memory and registers after it and flags.
+template<size_t N, typename Type, typename P>
+bool traces(const char *name) {
+    const char *path = "tmpasm_trace.bin";
+    constexpr auto code = Bytecode<P>::decode();
+    std::array<Type, N> memory{};
+    TracingComputer<N, Type>::run(std::vector<Instruction>(code.begin(), code.end()), memory,
+                                  path);
+    TraceReader reader(path);
+    std::remove(path);
+
+    auto env = Computer<N, Type>::template initial<P>();
+    bool same = reader.code.size() == code.size();
+    TraceStep step;
+    while (same && reader.next(step)) {
+        while (code[env.pc].type == LABEL || code[env.pc].type == DECL)
+            ++env.pc;
+        same = step.pc == env.pc;
+        env = Computer<N, Type>::template boot<P>(env, 1);
+        for (size_t addr = 0; addr < N; ++addr)
+            same &= reader.memory[addr] == static_cast<int64_t>(env.memory[addr]);
+        for (size_t reg = 0; reg < REGISTERS; ++reg)
+            same &= reader.registers[reg] == static_cast<int64_t>(env.registers[reg]);
+        same &= step.ZF == env.flags.ZF() && step.SF == env.flags.SF();
+    }
+    if (same && reader.error.empty() && Computer<N, Type>::template finished<P>(env) &&
+        compare(memory, env.memory))
+        return true;
+    std::cerr << "Failed [" << name << "] trace." << std::endl;
+    return false;
+}
+
+// Every program of the corpus, with words of Type.
+template<typename Type>
+bool matches_boot() {
+    bool ok = matches_boot<1, Type, tmpasm_move>("tmpasm_move", tmpasm_move_source);
+    ok &= matches_boot<1, Type, tmpasm_jump>("tmpasm_jump", tmpasm_jump_source);
+    ok &= matches_boot<4, Type, tmpasm_data>("tmpasm_data", tmpasm_data_source);
+    ok &= matches_boot<5, Type, tmpasm_operations>("tmpasm_operations", tmpasm_operations_source);
+    ok &= matches_boot<11, Type, tmpasm_helloworld>("tmpasm_helloworld",
+                                                    tmpasm_helloworld_source);
+    ok &= matches_boot<2, Type, tmpasm_sign>("tmpasm_sign", tmpasm_sign_source);
+    ok &= matches_boot<4, Type, tmpasm_flags>("tmpasm_flags", tmpasm_flags_source);
+    ok &= matches_boot<3, Type, tmpasm_indirect>("tmpasm_indirect", tmpasm_indirect_source);
+    ok &= matches_boot<2, Type, tmpasm_duplicates>("tmpasm_duplicates", tmpasm_duplicates_source);
+    ok &= matches_boot<2, Type, tmpasm_loop>("tmpasm_loop", tmpasm_loop_source);
+    ok &= matches_boot<1, Type, tmpasm_halt>("tmpasm_halt", tmpasm_halt_source);
+    ok &= matches_boot<1, Type, tmpasm_nested>("tmpasm_nested", tmpasm_nested_source);
+    ok &= matches_boot<2, Type, tmpasm_memo>("tmpasm_memo", tmpasm_memo_source);
+    ok &= matches_boot<10, Type, tmpasm_blocks>("tmpasm_blocks", tmpasm_blocks_source);
+    ok &= matches_boot<3, Type, tmpasm_registers>("tmpasm_registers", tmpasm_registers_source);
+    ok &= matches_boot<2, Type, tmpasm_wrap>("tmpasm_wrap", tmpasm_wrap_source);
+    ok &= matches_boot<4, Type, tmpasm_peephole>("tmpasm_peephole", tmpasm_peephole_source);
+    ok &= matches_boot<5, Type, tmpasm_counted>("tmpasm_counted", tmpasm_counted_source);
+    return ok;
+}
 
 int main() {
             Computer<1, int8_t>::boot<tmpasm_move>();
 
             Computer<11, char>::boot<tmpasm_helloworld>();
-/*
+
     static_assert(compare(
             Computer<1, int8_t>::boot<tmpasm_move>(),
             std::array<int8_t, 1>({42})),
@@ -87,5 +616,212 @@ int main() {
             Computer<11, char>::boot<tmpasm_helloworld>(),
             std::array<char, 11>({'h', 'e', 'l', 'l', 'o', ' ', 'w', 'o', 'r', 'l', 'd'})),
             "Failed [tmpasm_helloworld].");
-*/
+
+    static_assert(compare(
+            Computer<2, int8_t>::boot<tmpasm_sign>(),
+            std::array<int8_t, 2>({-1, 2})),
+            "Failed [tmpasm_sign].");
+
+    static_assert(compare(
+            Computer<2, uint8_t>::boot<tmpasm_sign>(),
+            std::array<uint8_t, 2>({255, 1})),
+            "Failed [tmpasm_sign].");
+
+    static_assert(compare(
+            Computer<2, uint64_t>::boot<tmpasm_sign>(),
+            std::array<uint64_t, 2>({UINT64_MAX, 1})),
+            "Failed [tmpasm_sign].");
+
+    static_assert(compare(
+            Computer<4, int8_t>::boot<tmpasm_flags>(),
+            std::array<int8_t, 4>({-128, 0, 1, 1})),
+            "Failed [tmpasm_flags].");
+
+    static_assert(compare(
+            Computer<4, uint8_t>::boot<tmpasm_flags>(),
+            std::array<uint8_t, 4>({128, 0, 1, 0})),
+            "Failed [tmpasm_flags].");
+
+    static_assert(compare(
+            Computer<4, int32_t>::boot<tmpasm_flags>(),
+            std::array<int32_t, 4>({128, 0, 1, 0})),
+            "Failed [tmpasm_flags].");
+
+    static_assert(compare(
+            Computer<3, int16_t>::boot<tmpasm_indirect>(),
+            std::array<int16_t, 3>({8, 2, 7})),
+            "Failed [tmpasm_indirect].");
+
+    static_assert(compare(
+            Computer<2, int>::boot<tmpasm_duplicates>(),
+            std::array<int, 2>({3, 2})),
+            "Failed [tmpasm_duplicates].");
+
+    static_assert(compare(
+            Computer<2, int64_t>::boot<tmpasm_loop>(),
+            std::array<int64_t, 2>({5000, 12497500})),
+            "Failed [tmpasm_loop].");
+
+    // Optimized boot gives the same memory as unoptimized profile, with fewer instructions.
+    static_assert(compare(
+            Computer<4, int>::boot<tmpasm_peephole>(),
+            std::array<int, 4>({4, 0, 1, 9})),
+            "Failed [tmpasm_peephole].");
+
+    static_assert(compare(
+            Computer<4, int>::profile<tmpasm_peephole>().memory,
+            std::array<int, 4>({4, 0, 1, 9})),
+            "Failed [tmpasm_peephole].");
+
+    static_assert(compare(
+            Computer<4, uint8_t>::boot<tmpasm_peephole>(),
+            std::array<uint8_t, 4>({4, 0, 1, 255})),
+            "Failed [tmpasm_peephole].");
+
+    static_assert(compare(
+            Computer<4, uint8_t>::profile<tmpasm_peephole>().memory,
+            std::array<uint8_t, 4>({4, 0, 1, 255})),
+            "Failed [tmpasm_peephole].");
+
+    static_assert(compare(
+            Computer<1, int>::boot<tmpasm_halt>(),
+            std::array<int, 1>({1})),
+            "Failed [tmpasm_halt].");
+
+    static_assert(stops<1, int, tmpasm_halt, 2>(HALTED, 0) &&
+                  stops<1, int, tmpasm_halt, 1>(OUT_OF_STEPS, 0), "Failed [tmpasm_halt].");
+
+    // Budgets count the 24999 instructions of tmpasm_loop as written, without labels and
+    // declarations, the same as boot(env, steps).
+    static_assert(compare(
+            Computer<2, int64_t>::boot<tmpasm_loop, 24999>(),
+            std::array<int64_t, 2>({5000, 12497500})),
+            "Failed [tmpasm_loop].");
+
+    static_assert(stops<2, int64_t, tmpasm_loop, 24998>(OUT_OF_STEPS, Id("end")),
+                  "Failed [tmpasm_loop].");
+
+    static_assert(stops<2, int64_t, tmpasm_loop, 100>(OUT_OF_STEPS, Id("loop")),
+                  "Failed [tmpasm_loop].");
+
+    static_assert(Computer<2, int64_t>::finished<tmpasm_loop>(
+            Computer<2, int64_t>::boot<tmpasm_loop>(
+                    Computer<2, int64_t>::initial<tmpasm_loop>(), 24999)),
+            "Failed [tmpasm_loop].");
+
+    static_assert(!Computer<2, int64_t>::finished<tmpasm_loop>(
+            Computer<2, int64_t>::boot<tmpasm_loop>(
+                    Computer<2, int64_t>::initial<tmpasm_loop>(), 24998)),
+            "Failed [tmpasm_loop].");
+
+    static_assert(resumed_loop<int64_t>(1000) && resumed_loop<uint16_t>(7),
+                  "Failed [tmpasm_loop].");
+
+    // Without watch, states are hashed only after the budget.
+    static_assert(stops<1, int, tmpasm_spin, 1000>(REPEATED, Id("spin")),
+                  "Failed [tmpasm_spin].");
+
+    static_assert(stops<1, int, tmpasm_spin, SIZE_MAX, true>(REPEATED, Id("spin")),
+                  "Failed [tmpasm_spin].");
+
+    static_assert(stops<2, int64_t, tmpasm_loop, SIZE_MAX, true>(HALTED, Id("end")),
+                  "Failed [tmpasm_loop].");
+
+    static_assert(compare(
+            Computer<1, int8_t>::boot<tmpasm_nested>(),
+            std::array<int8_t, 1>({11})),
+            "Failed [tmpasm_nested].");
+
+    static_assert(compare(
+            Computer<2, int>::boot<tmpasm_memo>(),
+            std::array<int, 2>({3, 6})),
+            "Failed [tmpasm_memo].");
+
+    // The body of sq runs for the first two calls, not for the third.
+    static_assert(Computer<2, int>::profile<tmpasm_memo>().counts[15] == 2,
+                  "Failed [tmpasm_memo].");
+
+    static_assert(compare(
+            Computer<10, int16_t>::boot<tmpasm_blocks>(),
+            std::array<int16_t, 10>({7, 7, 8, 8, 9, 7, 0, 0, 1, 1})),
+            "Failed [tmpasm_blocks].");
+
+    static_assert(compare(
+            Computer<10, uint32_t>::boot<tmpasm_blocks>(),
+            std::array<uint32_t, 10>({7, 7, 8, 8, 9, 7, 0, 0, 1, 0})),
+            "Failed [tmpasm_blocks].");
+
+    static_assert(compare(
+            Computer<3, int8_t>::boot<tmpasm_registers>(),
+            std::array<int8_t, 3>({0, 3, 7})),
+            "Failed [tmpasm_registers].");
+
+    // Unsigned types never set SF.
+    static_assert(wrap_flags<int8_t>(1, false, true) && wrap_flags<int8_t>(2, true, false) &&
+                  wrap_flags<int8_t>(3, false, true), "Failed [tmpasm_wrap].");
+
+    static_assert(wrap_flags<uint8_t>(1, false, false) && wrap_flags<uint8_t>(2, true, false) &&
+                  wrap_flags<uint8_t>(3, false, false), "Failed [tmpasm_wrap].");
+
+    static_assert(wrap_flags<int32_t>(1, false, false) && wrap_flags<int32_t>(2, true, false) &&
+                  wrap_flags<int32_t>(3, false, true), "Failed [tmpasm_wrap].");
+
+    static_assert(wrap_flags<uint64_t>(2, true, false) && wrap_flags<uint64_t>(3, false, false),
+                  "Failed [tmpasm_wrap].");
+
+    static_assert(echoed<int8_t>() && echoed<uint16_t>() && echoed<int64_t>(),
+                  "Failed [tmpasm_echo].");
+
+    static_assert(profiled_loop<int64_t>(), "Failed [tmpasm_loop].");
+
+    static_assert(profiled_loop<uint16_t>(), "Failed [tmpasm_loop].");
+
+    static_assert(optimize<int, 4>(Bytecode<tmpasm_peephole>::decode()).length <
+                  Bytecode<tmpasm_peephole>::size,
+                  "Failed [tmpasm_peephole].");
+
+    static_assert(optimize<char, 11>(Bytecode<tmpasm_helloworld>::decode()).length <
+                  Bytecode<tmpasm_helloworld>::size,
+                  "Failed [tmpasm_helloworld].");
+
+    static_assert(folded<5, int64_t, tmpasm_counted>(), "Failed [tmpasm_counted].");
+
+    // The loop runs c times modulo the word size.
+    static_assert(compare(
+            Computer<5, int64_t>::boot<tmpasm_counted>(),
+            std::array<int64_t, 5>({0, 3000000, 7, 7000000, 1})),
+            "Failed [tmpasm_counted].");
+
+    static_assert(compare(
+            Computer<5, uint16_t>::boot<tmpasm_counted>(),
+            std::array<uint16_t, 5>({0, 50880, 7, 53184, 1})),
+            "Failed [tmpasm_counted].");
+
+    static_assert(compare(
+            Computer<5, int8_t>::boot<tmpasm_counted>(),
+            std::array<int8_t, 5>({0, -64, 7, -64, 1})),
+            "Failed [tmpasm_counted].");
+
+    bool ok = matches_boot<int8_t>() & matches_boot<uint8_t>() & matches_boot<int16_t>() &
+              matches_boot<uint16_t>() & matches_boot<int32_t>() & matches_boot<uint32_t>() &
+              matches_boot<int64_t>() & matches_boot<uint64_t>();
+    ok &= traces<2, int64_t, tmpasm_loop>("tmpasm_loop") &
+          traces<1, uint8_t, tmpasm_nested>("tmpasm_nested") &
+          traces<10, int16_t, tmpasm_blocks>("tmpasm_blocks") &
+          traces<3, int8_t, tmpasm_registers>("tmpasm_registers") &
+          traces<2, uint32_t, tmpasm_wrap>("tmpasm_wrap");
+    ok &= echoes<int8_t>(0) & echoes<int8_t>(100) & echoes<uint32_t>(100000);
+    ok &= parse_fails("D a 1\ninc [b]\n", "Id not found", 2);
+    ok &= parse_fails("inc [0]\nl: inc [0]\n", "Unexpected 'inc [0]'", 2);
+    ok &= parse_fails("mov [0], 'ab'\n", "Invalid character", 1);
+    ok &= parse_fails("jmp far\n", "Label doesn't exist", 1);
+    ok &= run_fails<2, int, tmpasm_crowded>("tmpasm_crowded", "Not enough memory for variables");
+    ok &= run_fails<1, int, tmpasm_return>("tmpasm_return", "Ret without Call");
+    ok &= run_fails<10, int, tmpasm_overrun>("tmpasm_overrun",
+                                             "Address out of Computer's memory");
+    ok &= rejected<4, int, tmpasm_register>("tmpasm_register", "Register out of register file");
+    ok &= rejected<4, int, tmpasm_far>("tmpasm_far", "Address out of Computer's memory");
+    ok &= rejected<400, uint8_t, tmpasm_wide>(
+            "tmpasm_wide", "Index for an array exceeds Computer's memory type max value");
+    return ok ? 0 : 1;
 }
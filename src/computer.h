@@ -1,18 +1,46 @@
 #ifndef COMPUTER_H
 #define COMPUTER_H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cstring>
 #include <type_traits>
 #include <limits>
 #include <cstdint>
 #include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
 
 
 namespace {
     enum OpType {
-        LABEL, JMP, JZ, JS, DECL, LEA, MEM, NUM, MOV,
-        AND, OR, NOT, ADD, SUB, INC, DEC, CMP
+        LABEL, JMP, JZ, JS, DECL, LEA, MEM, NUM, REG, MOV,
+        AND, OR, NOT, ADD, SUB, INC, DEC, CMP, CALL, RET, HLT, FILL, COPY, CMPRANGE, IN, OUT,
+        XADD, CMPXCHG, FENCE,
+        // Counted loop evaluated at once, made by fold_loops.
+        LOOP
+    };
+
+    // Decoded pvalue: value of Num (or address of Lea) dereferenced depth times. Reg is
+    // dereferenced in the register file first, so its depth is at least 1.
+    struct Operand {
+        OpType kind = NUM;
+        uint64_t value = 0;
+        // Num value is stored as uint64_t, so its sign is kept separately.
+        bool negative = false;
+        size_t depth = 0;
+    };
+
+    // Decoded instruction. Jump targets are resolved to instruction indexes, jumps keep Id of
+    // their label in arg1 for diagnostics. Block instructions keep their length in arg3.
+    struct Instruction {
+        OpType type = LABEL;
+        Operand arg1{}, arg2{};
+        size_t target = 0;
+        Operand arg3{};
     };
 }
 
@@ -21,6 +49,12 @@ struct Label {
     static constexpr OpType type = LABEL;
     static constexpr uint64_t id = Id;
 
+    // Labels are resolved during decoding, so label does nothing.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {LABEL};
+    }
+
     constexpr static void check() {}
 };
 
@@ -42,107 +76,358 @@ namespace {
         throw "Character out of range";
     }
 
-    // struct D and Lea helper function, gets variable address whose Id is id.
-    // Otherwise returns size.
-    template<size_t memSize>
-    constexpr size_t get_addr(uint64_t id, std::array<uint64_t, memSize> &addr, size_t sz) {
-        for (size_t i = 0; i < sz; ++i) {
-            if (addr[i] == id)
-                return i;
+    // Gets name of an Id in lower case. Characters are digits 1, ..., ALLOWED_CHAR_CNT of it.
+    constexpr std::array<char, MAX_ID_LEN + 1> id_name(uint64_t id) {
+        std::array<char, MAX_ID_LEN + 1> name{};
+        for (size_t i = 0; id != 0 && i < MAX_ID_LEN; ++i) {
+            uint64_t digit = id % ALLOWED_CHAR_CNT;
+            if (digit == 0)
+                digit = ALLOWED_CHAR_CNT;
+            id = (id - digit) / ALLOWED_CHAR_CNT;
+            name[i] = static_cast<char>(digit <= 10 ? '0' + digit - 1 : 'a' + digit - 11);
         }
-        return sz;
+        return name;
     }
 
-    // Describes Computer state.
-    template<typename memType, size_t N>
-    struct Env {
-        std::array<memType, N> memory{};
-        // addresses[i] = id <-> id value is in memory[i]
-        std::array<uint64_t, N> addresses{};
-        bool ZF = false, SF = false;
-        // There could be less than N variables.
-        size_t variables_cnt = 0;
+    constexpr size_t id_length(uint64_t id) {
+        size_t length = 0;
+        while (id_name(id)[length] != '\0')
+            ++length;
+        return length;
+    }
+
+    // Computer flags. They are kept apart from memory, which may be owned by the caller.
+    // Only results of the instructions which set them are stored, jumps compute the flags.
+    template<typename memType>
+    struct Flags {
+        // ZF is set when zero is 0 and SF when sign is negative. Logical operations change
+        // only zero, arithmetic on unsigned types never sets SF.
+        memType zero = 1, sign = 0;
+
+        constexpr bool ZF() const {
+            return zero == 0;
+        }
+
+        constexpr bool SF() const {
+            return static_cast<typename std::make_signed<memType>::type>(sign) < 0;
+        }
+
+        constexpr void set(bool ZF, bool SF) {
+            zero = !ZF;
+            sign = SF ? static_cast<memType>(-1) : 0;
+        }
 
         // Updates flags after an arithmetic operation.
         constexpr void update_flags(memType val) {
-            ZF = val == 0;
-            SF = val < 0;
+            zero = val;
+            sign = std::is_signed<memType>::value ? val : 0;
         }
-    };
 
-//----------------HANDLING LABELS-------------------
-    template<typename Label, typename Program>
-    struct LabelHolder {
-        using program = Program;
-        using label = Label;
+        // Updates ZF after a logical operation.
+        constexpr void update_zero(memType val) {
+            zero = val;
+        }
     };
 
-    template<typename... Labels>
-    struct LabelList;
+    // Return addresses of called subroutines.
+    struct CallStack {
+        static constexpr size_t DEPTH = 256;
 
-    // Create list
+        std::array<size_t, DEPTH> pcs{};
+        size_t size = 0;
 
-    // Recursion if label
-    template<template<typename...> class Program, typename... Ops, typename... Labels, uint64_t n>
-    struct LabelList<Program<Label<n>, Ops...>, Labels...> {
-        using result =
-        typename LabelList<Program<Ops...>, Labels...,
-                LabelHolder<Label<n>, Program<Ops...>>>::result;
-    };
+        constexpr void push(size_t pc) {
+            if (size == DEPTH)
+                throw "Call stack overflow";
+            pcs[size++] = pc;
+        }
 
-    // Recursion otherwise
-    template<template<typename...> class Program, typename... Ops, typename Op, typename... Labels>
-    struct LabelList<Program<Op, Ops...>, Labels...> {
-        using result = typename LabelList<Program<Ops...>, Labels...>::result;
+        constexpr size_t pop() {
+            if (size == 0)
+                throw "Ret without Call";
+            return pcs[--size];
+        }
     };
 
-    // Base case if label
-    template<template<typename...> class Program, typename... Labels, uint64_t n>
-    struct LabelList<Program<Label<n>>, Labels...> {
-        using result =
-        LabelList<Program<>, Labels..., LabelHolder<Label<n>, Program<>>>;
+    // Registers of Computer, zeroed before the program starts.
+    constexpr size_t REGISTERS = 8;
+
+    // Describes Computer state.
+    template<typename memType, size_t N>
+    struct Env {
+        std::array<memType, N> memory{};
+        Flags<memType> flags{};
+        // Index of the next instruction of the decoded program, its size after the end.
+        size_t pc = 0;
+        CallStack calls{};
+        std::array<memType, REGISTERS> registers{};
     };
 
-    // Base case otherwise
-    template<template<typename...> class Program, typename Op, typename... Labels>
-    struct LabelList<Program<Op>, Labels...> {
-        using result = LabelList<Program<>, Labels...>;
+//----------------DECODED PROGRAM-------------------
+    template<typename T>
+    constexpr bool is_negative(T val) {
+        if constexpr (std::is_signed<T>::value)
+            return val < 0;
+        else
+            return false;
+    }
+
+    // Checks if address matches with unsigned version of memType and Computer's memory.
+    template<typename memType, size_t memSize, typename T>
+    constexpr size_t check_address(T addr, bool negative) {
+        if (negative) {
+            throw "Invalid address";
+        }
+        if (static_cast<typename std::make_unsigned<T>::type>(addr) >
+            std::numeric_limits<typename std::make_unsigned<memType>::type>::max()) {
+            throw "Index for an array exceeds Computer's memory type max value";
+        }
+        if (static_cast<uint64_t>(addr) >= memSize) {
+            throw "Address out of Computer's memory";
+        }
+        return static_cast<size_t>(addr);
+    }
+
+    // Same checks as check_address, for code which reports no errors.
+    template<typename memType, size_t memSize>
+    constexpr bool valid_address(uint64_t addr, bool negative) {
+        return !negative &&
+               addr <= std::numeric_limits<typename std::make_unsigned<memType>::type>::max() &&
+               addr < memSize;
+    }
+
+    // Operand which is a register, not a memory cell.
+    constexpr bool is_register(const Operand &op) {
+        return op.kind == REG && op.depth == 1;
+    }
+
+    // Computer memory accessed through decoded operands, cells may be owned by the caller.
+    template<typename memType, size_t memSize>
+    struct Memory {
+        memType *cells;
+        memType *registers = nullptr;
+
+        // Gets address of memory cell accessed by operand with positive depth, which is not
+        // a register. Only addresses read from memory or registers are checked, constant ones
+        // are checked by check_addresses.
+        constexpr size_t address(const Operand &op) const {
+            size_t addr = static_cast<size_t>(op.value);
+            // Reg has one level more, read from registers.
+            const memType *from = op.kind == REG ? registers : cells;
+            for (size_t i = 1; i < op.depth; ++i) {
+                memType val = from[addr];
+                addr = check_address<memType, memSize>(val, is_negative(val));
+                from = cells;
+            }
+            return addr;
+        }
+
+        // Gets memory cell or register accessed by lvalue operand.
+        constexpr memType &lvalue(const Operand &op) const {
+            if (op.depth == 1)
+                return op.kind == REG ? registers[op.value] : cells[op.value];
+            return cells[address(op)];
+        }
+
+        // Gets a value of pvalue operand.
+        constexpr memType pvalue(const Operand &op) const {
+            if (op.depth == 0)
+                return static_cast<memType>(op.value);
+            return lvalue(op);
+        }
+        // Gets length of a block instruction starting at addr, the block has to fit in memory.
+        constexpr size_t length(size_t addr, const Operand &op) const {
+            memType len = pvalue(op);
+            if (is_negative(len))
+                throw "Invalid length";
+            if (static_cast<uint64_t>(len) > memSize - addr)
+                throw "Address out of Computer's memory";
+            return static_cast<size_t>(len);
+        }
     };
 
-    // Empty program
-    template<template<typename...> class Program>
-    struct LabelList<Program<>> {
-        template<uint64_t id, size_t memSize, typename memType, typename labels>
-        static constexpr void find_and_run(Env<memType, memSize> &) {}
+    constexpr bool is_block(OpType type) {
+        return type == FILL || type == COPY || type == CMPRANGE;
+    }
+
+    constexpr bool has_blocks(const Instruction *code, size_t size) {
+        for (size_t pc = 0; pc < size; ++pc) {
+            if (is_block(code[pc].type))
+                return true;
+        }
+        return false;
+    }
+
+    constexpr bool has_registers(const Instruction *code, size_t size) {
+        for (size_t pc = 0; pc < size; ++pc) {
+            const Instruction &ins = code[pc];
+            if (ins.arg1.kind == REG || ins.arg2.kind == REG || ins.arg3.kind == REG)
+                return true;
+        }
+        return false;
+    }
+
+    // Instructions which are atomic on memory shared by several cores.
+    constexpr bool is_atomic(OpType type) {
+        return type == XADD || type == CMPXCHG || type == FENCE;
+    }
 
-        using result = LabelList<Program<>>;
+    constexpr bool has_atomics(const Instruction *code, size_t size) {
+        for (size_t pc = 0; pc < size; ++pc) {
+            if (is_atomic(code[pc].type))
+                return true;
+        }
+        return false;
+    }
+
+//-----------------PORTS--------------------------
+    // Ports of In and Out, numbered from 0.
+    constexpr size_t PORTS = 8;
+
+    constexpr bool is_port(OpType type) {
+        return type == IN || type == OUT;
+    }
+
+    constexpr bool has_ports(const Instruction *code, size_t size) {
+        for (size_t pc = 0; pc < size; ++pc) {
+            if (is_port(code[pc].type))
+                return true;
+        }
+        return false;
+    }
+
+    // Source or sink of values of a port at runtime, which gives the port its buffers.
+    template<typename memType>
+    class PortStream {
+    public:
+        virtual ~PortStream() = default;
+
+        // Sets [next, end) to the following values, returns false at the end of input.
+        virtual bool read(const memType *&, const memType *&) {
+            throw "Port is not readable";
+        }
+
+        // Takes values written before next, sets [next, end) to free cells.
+        virtual void write(memType *&, memType *&) {
+            throw "Port is not writable";
+        }
     };
 
-    // Handle Jump operations
+    // Ports of a running program: In reads values [next, end) of its port, Out writes to free
+    // cells [next, end). Used up buffers are replaced by the stream of the port, without one
+    // (e.g. arrays during compilation) the input ends and a full output fails. Inputs which are
+    // not connected have no values.
+    template<typename memType>
+    struct Ports {
+        template<typename Cell>
+        struct Buffer {
+            Cell *next = nullptr, *end = nullptr;
+            PortStream<memType> *stream = nullptr;
+        };
+
+        std::array<Buffer<const memType>, PORTS> inputs{};
+        std::array<Buffer<memType>, PORTS> outputs{};
+
+        // Connects In of port to count values.
+        constexpr void input(size_t port, const memType *values, size_t count) {
+            inputs[port] = {values, values + count, nullptr};
+        }
 
-    // Recursion
-    template<template<typename...> class Program, typename Label, typename... Labels>
-    struct LabelList<Program<>, Label, Labels...> {
-        template<uint64_t id, size_t memSize, typename memType, typename labels>
-        static constexpr void find_and_run(Env<memType, memSize> &env) {
-            if constexpr (Label::label::id == id) {
-                Label::program::template run<memSize, memType, labels>(env);
-            } else {
-                LabelList<Program<>, Labels...>::template
-                find_and_run<id, memSize, memType, labels>(env);
+        void input(size_t port, PortStream<memType> &stream) {
+            inputs[port] = {nullptr, nullptr, &stream};
+        }
+
+        // Connects Out of port to count cells.
+        constexpr void output(size_t port, memType *cells, size_t count) {
+            outputs[port] = {cells, cells + count, nullptr};
+        }
+
+        void output(size_t port, PortStream<memType> &stream) {
+            outputs[port] = {nullptr, nullptr, &stream};
+        }
+
+        // Gets port from the value of the port operand.
+        static constexpr size_t port(memType val) {
+            if (is_negative(val) || static_cast<uint64_t>(val) >= PORTS)
+                throw "Invalid port";
+            return static_cast<size_t>(val);
+        }
+
+        // Reads the next value of port, returns false at the end of its input.
+        constexpr bool read(size_t port, memType &val) {
+            Buffer<const memType> &in = inputs[port];
+            while (in.next == in.end) {
+                if (!in.stream || !in.stream->read(in.next, in.end))
+                    return false;
             }
+            val = *in.next++;
+            return true;
         }
-    };
 
-    // Base case
-    template<template<typename...> class Program, typename Label>
-    struct LabelList<Program<>, Label> {
-        template<uint64_t id, size_t memSize, typename memType, typename labels>
-        static constexpr void find_and_run(Env<memType, memSize> &env) {
-            static_assert(Label::label::id == id, "Label doesn't exist");
-            Label::program::template run<memSize, memType, labels>(env);
+        constexpr void write(size_t port, memType val) {
+            Buffer<memType> &out = outputs[port];
+            while (out.next == out.end) {
+                if (out.stream)
+                    out.stream->write(out.next, out.end);
+                else if (out.end)
+                    throw "Output port is full";
+                else
+                    throw "Port is not connected";
+            }
+            *out.next++ = val;
+        }
+
+        // Passes values left in buffers of outputs to their streams.
+        void flush() {
+            for (Buffer<memType> &out : outputs) {
+                if (out.stream)
+                    out.stream->write(out.next, out.end);
+            }
         }
     };
+
+    // Checks addresses known before execution: first cells accessed by operands, registers,
+    // memoized cells, blocks of constant addresses and length, and constant ports.
+    template<typename memType, size_t memSize>
+    constexpr void check_addresses(const Instruction *code, size_t size) {
+        for (size_t pc = 0; pc < size; ++pc) {
+            const Instruction &ins = code[pc];
+            if (ins.type == CALL) {
+                if (ins.arg2.value != 0) {
+                    size_t first = check_address<memType, memSize>(ins.arg1.value,
+                                                                   ins.arg1.negative);
+                    check_address<memType, memSize>(first + ins.arg2.value - 1, false);
+                }
+                continue;
+            }
+            // Jumps keep their label in arg1, as a number.
+            for (const Operand *op : {&ins.arg1, &ins.arg2, &ins.arg3}) {
+                if (op->kind == REG && op->value >= REGISTERS)
+                    throw "Register out of register file";
+                if (op->kind != REG && op->depth > 0)
+                    check_address<memType, memSize>(op->value, op->negative);
+            }
+            if (is_block(ins.type) &&
+                (is_register(ins.arg1) || (ins.type != FILL && is_register(ins.arg2))))
+                throw "Block range has to be in memory";
+            const Operand &port = ins.type == IN ? ins.arg2 : ins.arg1;
+            if (is_port(ins.type) && port.depth == 0 && (port.negative || port.value >= PORTS))
+                throw "Invalid port";
+            bool constant = ins.arg1.kind != REG && ins.arg1.depth == 1 &&
+                            ins.arg3.depth == 0 &&
+                            (ins.type == FILL || (ins.arg2.kind != REG && ins.arg2.depth == 1));
+            if (is_block(ins.type) && constant) {
+                uint64_t last = ins.type != FILL && ins.arg2.value > ins.arg1.value ?
+                                ins.arg2.value : ins.arg1.value;
+                // Constant length is read without memory.
+                Memory<memType, memSize>{nullptr}.length(static_cast<size_t>(last), ins.arg3);
+            }
+        }
+    }
+
+    // Defined after Program, which checks its decoded instructions.
+    template<typename Program>
+    struct Bytecode;
 } // anonymous namespace
 
 //-------------OPERATIONS---------------------------
@@ -172,9 +457,9 @@ struct Num {
     static constexpr OpType type = NUM;
     static_assert(std::is_integral<decltype(N)>::value, "Integral required.");
 
-    template<typename memType, size_t memSize>
-    constexpr static auto get(Env<memType, memSize> &) {
-        return N;
+    template<typename Bytecode>
+    constexpr static Operand operand() {
+        return {NUM, static_cast<uint64_t>(N), is_negative(N), 0};
     }
 
     constexpr static void check_pvalue() {}
@@ -185,50 +470,46 @@ template<uint64_t id>
 struct Lea {
     static constexpr OpType type = LEA;
 
-    template<typename memType, size_t memSize>
-    constexpr static size_t get(Env<memType, memSize> &env) {
-        size_t addr = get_addr<memSize>(id, env.addresses, env.variables_cnt);
-        if (addr == env.variables_cnt) {
-            throw "Id not found";
-        }
-        return addr;
+    // Variable addresses are known from declarations, so Lea is a constant.
+    template<typename Bytecode>
+    constexpr static Operand operand() {
+        constexpr size_t addr = Bytecode::variable_address(id);
+        static_assert(addr != Bytecode::size, "Id not found");
+        return {LEA, addr, false, 0};
     }
 
     constexpr static void check_pvalue() {}
 };
 
+// Register i of the register file, accessed without address checks.
+template<size_t i>
+struct Reg {
+    static constexpr OpType type = REG;
+
+    template<typename Bytecode>
+    constexpr static Operand operand() {
+        return {REG, i, false, 1};
+    }
+
+    constexpr static void check_lvalue() {
+        static_assert(i < REGISTERS, "Register out of register file");
+    }
+
+    constexpr static void check_pvalue() {
+        check_lvalue();
+    }
+};
+
 template<typename pvalue>
 struct Mem {
     static constexpr OpType type = MEM;
 
-    // Gets a pointer to assigned pvalue.
-    template<typename memType, size_t memSize>
-    constexpr static memType* get_pointer(Env<memType, memSize> &env) {
-        auto addr = pvalue::template get<memType, memSize>(env);
-        // Checking if address matches with unsigned version of memType.
-        if (addr < 0) {
-            throw "Invalid address";
-        }
-        if (static_cast<typename std::make_unsigned<decltype(addr)>::type>(addr) >
-            std::numeric_limits<typename std::make_unsigned<memType>::type>::max()) {
-            throw "Index for an array exceeds Computer's memory type max value";
-        }
-        return &(env.memory[addr]);
-    }
-
-    // Gets a value of assigned pvalue.
-    template<typename memType, size_t memSize>
-    constexpr static memType get(Env<memType, memSize> &env) {
-        auto addr = pvalue::template get<memType, memSize>(env);
-        // Checking if address matches with unsigned version of memType.
-        if (addr < 0) {
-            throw "Invalid address";
-        }
-        if (static_cast<typename std::make_unsigned<decltype(addr)>::type>(addr) >
-            std::numeric_limits<typename std::make_unsigned<memType>::type>::max()) {
-            throw "Index for an array exceeds Computer's memory type max value";
-        }
-        return env.memory[addr];
+    // Memory access is one more dereference of assigned pvalue.
+    template<typename Bytecode>
+    constexpr static Operand operand() {
+        Operand op = pvalue::template operand<Bytecode>();
+        ++op.depth;
+        return op;
     }
 
     constexpr static void check_lvalue() {
@@ -254,14 +535,19 @@ struct D<id, Num<val>> {
     // Only declaration with Num is valid.
     static constexpr bool valid = true;
 
-    // Adds id to addresses array and assigns value to the according memory cell.
+    // Assigns value to the according memory cell, Lea finds it by declaration order.
     // Does not execute if there is no free memory.
     template<size_t memSize, typename memType, size_t var_count>
-    static constexpr void load_variable(Env<memType, memSize> &env) {
-        static_assert(var_count < memSize);
-        if (get_addr<memSize>(id, env.addresses, var_count) == var_count)
-            env.addresses[var_count] = id;
-        env.memory[var_count] = static_cast<memType>(val);
+    static constexpr void load_variable(memType *memory) {
+        static_assert(var_count < memSize, "Not enough memory for variables");
+        memory[var_count] = static_cast<memType>(val);
+    }
+
+    // Variables are loaded before execution, so declaration does nothing.
+    // Its value is kept for loading decoded programs.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {DECL, {}, Num<val>::template operand<Bytecode>()};
     }
 
     constexpr static void check() {}
@@ -272,10 +558,10 @@ struct Mov {
     static constexpr OpType type = MOV;
 
     // Lvalue = Pvalue
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        (*Lvalue::template get_pointer<memType, memSize>(env)) =
-                static_cast<memType>(Pvalue::template get<memType, memSize>(env));
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {MOV, Lvalue::template operand<Bytecode>(),
+                Pvalue::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -289,12 +575,10 @@ struct Add {
     static constexpr OpType type = ADD;
 
     // Lvalue += Pvalue
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        memType* lval = Lvalue::template get_pointer<memType, memSize>(env);
-        auto pval = static_cast<memType>(Pvalue::template get<memType, memSize>(env));
-        *lval += pval;
-        env.update_flags(*lval);
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {ADD, Lvalue::template operand<Bytecode>(),
+                Pvalue::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -308,12 +592,10 @@ struct Sub {
     static constexpr OpType type = SUB;
 
     // Lvalue -= Pvalue
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        memType* lval = Lvalue::template get_pointer<memType, memSize>(env);
-        auto pval = static_cast<memType>(Pvalue::template get<memType, memSize>(env));
-        *lval -= pval;
-        env.update_flags(*lval);
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {SUB, Lvalue::template operand<Bytecode>(),
+                Pvalue::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -326,12 +608,11 @@ template<typename Arg1, typename Arg2>
 struct Cmp {
     static constexpr OpType type = CMP;
 
-    // Same as Cmp but Arg1 does not change.
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        auto val = static_cast<memType>(Arg1::template get<memType, memSize>(env)) -
-                   static_cast<memType>(Arg2::template get<memType, memSize>(env));
-        env.update_flags(val);
+    // Same as Sub but Arg1 does not change.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {CMP, Arg1::template operand<Bytecode>(),
+                Arg2::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -345,11 +626,9 @@ struct Inc {
     static constexpr OpType type = INC;
 
     // Increases Lvalue by one.
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        memType* lval = Lvalue::template get_pointer<memType, memSize>(env);
-        *lval += 1;
-        env.update_flags(*lval);
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {INC, Lvalue::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -362,11 +641,9 @@ struct Dec {
     static constexpr OpType type = DEC;
 
     // Decreases Lvalue by one.
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        memType* lval = Lvalue::template get_pointer<memType, memSize>(env);
-        *lval -= 1;
-        env.update_flags(*lval);
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {DEC, Lvalue::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -379,11 +656,10 @@ struct And {
     static constexpr OpType type = AND;
 
     // Lvalue &= Pvalue
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        memType* lval = Lvalue::template get_pointer<memType, memSize>(env);
-        *lval &= static_cast<memType>(Pvalue::template get<memType, memSize>(env));
-        env.ZF = *lval == 0;
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {AND, Lvalue::template operand<Bytecode>(),
+                Pvalue::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -397,11 +673,10 @@ struct Or {
     static constexpr OpType type = OR;
 
     // Lvalue |= Pvalue
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        memType* lval = Lvalue::template get_pointer<memType, memSize>(env);
-        *lval |= static_cast<memType>(Pvalue::template get<memType, memSize>(env));
-        env.ZF = *lval == 0;
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {OR, Lvalue::template operand<Bytecode>(),
+                Pvalue::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -415,11 +690,9 @@ struct Not {
     static constexpr OpType type = NOT;
 
     // Lvalue ~= Lvalue
-    template<size_t memSize, typename memType>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        memType* lval = Lvalue::template get_pointer<memType, memSize>(env);
-        *lval = ~(*lval);
-        env.ZF = *lval == 0;
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {NOT, Lvalue::template operand<Bytecode>()};
     }
 
     constexpr static void check() {
@@ -427,14 +700,152 @@ struct Not {
     }
 };
 
+// BLOCKS
+template<typename Dst, typename Len, typename Val>
+struct Fill {
+    static constexpr OpType type = FILL;
+
+    // Len cells from Dst = Val
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {FILL, Dst::template operand<Bytecode>(), Val::template operand<Bytecode>(), 0,
+                Len::template operand<Bytecode>()};
+    }
+
+    constexpr static void check() {
+        Dst::check_lvalue();
+        Len::check_pvalue();
+        Val::check_pvalue();
+    }
+};
+
+template<typename Dst, typename Src, typename Len>
+struct Copy {
+    static constexpr OpType type = COPY;
+
+    // Len cells from Dst = Len cells from Src, ranges may overlap.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {COPY, Dst::template operand<Bytecode>(), Src::template operand<Bytecode>(), 0,
+                Len::template operand<Bytecode>()};
+    }
+
+    constexpr static void check() {
+        Dst::check_lvalue();
+        Src::check_lvalue();
+        Len::check_pvalue();
+    }
+};
+
+template<typename Arg1, typename Arg2, typename Len>
+struct CmpRange {
+    static constexpr OpType type = CMPRANGE;
+
+    // Same as Cmp of the first differing cells of the ranges, or of equal ones.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {CMPRANGE, Arg1::template operand<Bytecode>(),
+                Arg2::template operand<Bytecode>(), 0, Len::template operand<Bytecode>()};
+    }
+
+    constexpr static void check() {
+        Arg1::check_lvalue();
+        Arg2::check_lvalue();
+        Len::check_pvalue();
+    }
+};
+
+// PORTS
+template<typename Dst, typename Port>
+struct In {
+    static constexpr OpType type = IN;
+
+    // Dst = next value of Port, ZF = end of its input (then Dst = 0).
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {IN, Dst::template operand<Bytecode>(), Port::template operand<Bytecode>()};
+    }
+
+    constexpr static void check() {
+        Dst::check_lvalue();
+        Port::check_pvalue();
+    }
+};
+
+template<typename Port, typename Src>
+struct Out {
+    static constexpr OpType type = OUT;
+
+    // Writes Src to Port.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {OUT, Port::template operand<Bytecode>(), Src::template operand<Bytecode>()};
+    }
+
+    constexpr static void check() {
+        Port::check_pvalue();
+        Src::check_pvalue();
+    }
+};
+
+// ATOMICS
+template<typename Dst, typename Src>
+struct Xadd {
+    static constexpr OpType type = XADD;
+
+    // Src = Dst and Dst += Src at once, flags like Add.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {XADD, Dst::template operand<Bytecode>(), Src::template operand<Bytecode>()};
+    }
+
+    constexpr static void check() {
+        Dst::check_lvalue();
+        Src::check_lvalue();
+    }
+};
+
+template<typename Dst, typename Expected, typename New>
+struct CmpXchg {
+    static constexpr OpType type = CMPXCHG;
+
+    // Dst = New if Dst == Expected, otherwise Expected = Dst, at once. Flags like
+    // Cmp<Expected, Dst>, so ZF is set if Dst was written.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {CMPXCHG, Dst::template operand<Bytecode>(),
+                Expected::template operand<Bytecode>(), 0, New::template operand<Bytecode>()};
+    }
+
+    constexpr static void check() {
+        Dst::check_lvalue();
+        Expected::check_lvalue();
+        New::check_pvalue();
+    }
+};
+
+struct Fence {
+    static constexpr OpType type = FENCE;
+
+    // Memory accesses before the fence happen before the ones after it, for all cores.
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {FENCE};
+    }
+
+    constexpr static void check() {}
+};
+
 // JUMPS
 template<uint64_t Id>
 struct Jmp {
     static constexpr OpType type = JMP;
 
-    template<size_t memSize, typename memType, typename labels>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        labels::template find_and_run<Id, memSize, memType, labels>(env);
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        constexpr size_t target = Bytecode::label_address(Id);
+        static_assert(target != Bytecode::size, "Label doesn't exist");
+        return {JMP, {NUM, Id}, {}, target};
     }
 
     constexpr static void check() {}
@@ -444,9 +855,11 @@ template<uint64_t Id>
 struct Jz {
     static constexpr OpType type = JZ;
 
-    template<size_t memSize, typename memType, typename labels>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        labels::template find_and_run<Id, memSize, memType, labels>(env);
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        constexpr size_t target = Bytecode::label_address(Id);
+        static_assert(target != Bytecode::size, "Label doesn't exist");
+        return {JZ, {NUM, Id}, {}, target};
     }
 
     constexpr static void check() {}
@@ -456,139 +869,1982 @@ template<uint64_t Id>
 struct Js {
     static constexpr OpType type = JS;
 
-    template<size_t memSize, typename memType, typename labels>
-    static constexpr void execute(Env<memType, memSize> &env) {
-        labels::template find_and_run<Id, memSize, memType, labels>(env);
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        constexpr size_t target = Bytecode::label_address(Id);
+        static_assert(target != Bytecode::size, "Label doesn't exist");
+        return {JS, {NUM, Id}, {}, target};
     }
 
     constexpr static void check() {}
 };
 
-//------------------PROGRAM----------------------
-template<typename... Ops>
-struct Program;
+// Most cells a memoized subroutine may use.
+constexpr size_t MEMO_CELLS = 8;
+
+// Calls subroutine at label Id, Ret continues after the Call.
+// Call<Id, First, Num<count>> also memoizes the subroutine, which may use only count cells from
+// address First (Num or Lea): a call with the same values of them and flags is not executed,
+// its result is taken from a cache.
+template<uint64_t Id, typename... Cells>
+struct Call {
+    static constexpr OpType type = CALL;
+    static_assert(sizeof...(Cells) == 0, "Call takes a label, or a label, a cell and a count");
+
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        constexpr size_t target = Bytecode::label_address(Id);
+        static_assert(target != Bytecode::size, "Label doesn't exist");
+        return {CALL, {}, {}, target};
+    }
+
+    constexpr static void check() {}
+};
 
-// Recursion
-template<typename Op, typename... Ops>
-struct Program<Op, Ops...> {
+template<uint64_t Id, typename First, auto count>
+struct Call<Id, First, Num<count>> {
+    static constexpr OpType type = CALL;
+    static_assert(First::type == NUM || First::type == LEA, "Memoized cells need a constant");
+    static_assert(0 < count && count <= MEMO_CELLS, "Invalid count of memoized cells");
+
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        constexpr size_t target = Bytecode::label_address(Id);
+        static_assert(target != Bytecode::size, "Label doesn't exist");
+        return {CALL, First::template operand<Bytecode>(), {NUM, count}, target};
+    }
+
+    constexpr static void check() {}
+};
+
+struct Ret {
+    static constexpr OpType type = RET;
+
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {RET};
+    }
+
+    constexpr static void check() {}
+};
+
+// Stops the program.
+struct Hlt {
+    static constexpr OpType type = HLT;
+
+    template<typename Bytecode>
+    static constexpr Instruction decode() {
+        return {HLT};
+    }
+
+    constexpr static void check() {}
+};
 
+//------------------PROGRAM----------------------
+// Ops are expanded in array initializers, so instantiation depth does not grow with program
+// length, unlike recursion over Ops or fold expressions.
+template<typename... Ops>
+struct Program {
+    // Checks operands of instructions and, during compilation, addresses known before
+    // execution, so they are not checked when instructions are executed.
+    template<size_t memSize, typename memType>
     static constexpr void check_program() {
-        Op::check();
-        Program<Ops...>::check_program();
+        int checked[]{0, (Ops::check(), 0)...};
+        static_cast<void>(checked);
+        constexpr bool valid = (check_addresses<memType, memSize>(
+                Bytecode<Program>::decode().data(), sizeof...(Ops)), true);
+        static_cast<void>(valid);
     }
 
+    // Loads variables to cells from var_count in declaration order.
     template<size_t memSize, typename memType, size_t var_count>
-    static constexpr void load_variables(Env<memType, memSize> &env) {
+    static constexpr void load_variables(memType *memory) {
+        load_declared<memSize, memType, var_count>(memory, std::index_sequence_for<Ops...>());
+    }
+
+private:
+    // Gets cell of every Op's variable, the number of declarations before it.
+    static constexpr std::array<size_t, sizeof...(Ops) + 1> slots() {
+        constexpr bool declared[]{(Ops::type == DECL)..., false};
+        std::array<size_t, sizeof...(Ops) + 1> ans{};
+        for (size_t i = 0; i < sizeof...(Ops); ++i)
+            ans[i + 1] = ans[i] + declared[i];
+        return ans;
+    }
+
+    template<typename Op, size_t memSize, typename memType, size_t slot>
+    static constexpr int load_variable(memType *memory) {
         if constexpr (Op::type == DECL) {
             // Error if declaration doesn't have Num as argument.
             static_assert(Op::valid);
-            Op::template load_variable<memSize, memType, var_count>(env);
-            //There is now one more variable, so execute next call with var_count + 1.
-            Program<Ops...>::template load_variables<memSize, memType, var_count + 1>(env);
-        } else {
-            Program<Ops...>::template load_variables<memSize, memType, var_count>(env);
+            Op::template load_variable<memSize, memType, slot>(memory);
         }
+        return 0;
     }
 
-    template<size_t memSize, typename memType, typename labels>
-    static constexpr void run(Env<memType, memSize> &env) {
-        if constexpr(Op::type == JMP) {
-            // Jump and then don't execute current program again.
-            Op::template execute<memSize, memType, labels>(env);
-        } else if constexpr(Op::type == JZ) {
-            // Jump or execute current program.
-            if (env.ZF) {
-                Op::template execute<memSize, memType, labels>(env);
-            } else {
-                Program<Ops...>::template run<memSize, memType, labels>(env);
+    template<size_t memSize, typename memType, size_t var_count, size_t... I>
+    static constexpr void load_declared([[maybe_unused]] memType *memory,
+                                        std::index_sequence<I...>) {
+        [[maybe_unused]] constexpr auto slot = slots();
+        int loaded[]{0, load_variable<Ops, memSize, memType, var_count + slot[I]>(memory)...};
+        static_cast<void>(loaded);
+    }
+};
+
+namespace {
+//-----------------SUBROUTINES--------------------
+    // Checks that the subroutine memoized by Call at pc uses only its cells, returns and does
+    // not call others. It ends with the first Ret after all its jump targets.
+    constexpr void check_subroutine(const Instruction *code, size_t size, size_t pc) {
+        const Instruction &call = code[pc];
+        const uint64_t first = call.arg1.value, end = first + call.arg2.value;
+        // Registers are not memoized.
+        auto declared = [&](const Operand &op) {
+            return op.depth == 0 || (op.kind != REG && op.depth == 1 && !op.negative &&
+                                     first <= op.value && op.value < end);
+        };
+        // Blocks need constant addresses and length.
+        auto declared_block = [&](const Operand &op, const Operand &len) {
+            return op.kind != REG && op.depth == 1 && !op.negative && first <= op.value &&
+                   op.value < end && len.depth == 0 && !len.negative &&
+                   len.value <= end - op.value;
+        };
+        size_t reach = call.target;
+        for (size_t i = call.target;; ++i) {
+            if (i >= size)
+                throw "Memoized subroutine does not return";
+            const Instruction &ins = code[i];
+            switch (ins.type) {
+                case RET:
+                    if (i >= reach)
+                        return;
+                    break;
+                case CALL:
+                    throw "Memoized subroutine calls another one";
+                case IN:
+                case OUT:
+                    throw "Memoized subroutine uses ports";
+                case XADD:
+                case CMPXCHG:
+                case FENCE:
+                    throw "Memoized subroutine uses atomic instructions";
+                case JMP:
+                case JZ:
+                case JS:
+                    if (ins.target < call.target)
+                        throw "Memoized subroutine jumps out of it";
+                    if (ins.target > reach)
+                        reach = ins.target;
+                    break;
+                case LABEL:
+                case DECL:
+                    break;
+                case FILL:
+                case COPY:
+                case CMPRANGE:
+                    if (!declared_block(ins.arg1, ins.arg3) ||
+                        !(ins.type == FILL ? declared(ins.arg2) :
+                          declared_block(ins.arg2, ins.arg3)))
+                        throw "Memoized subroutine uses undeclared memory";
+                    break;
+                default:
+                    if (!declared(ins.arg1) || !declared(ins.arg2))
+                        throw "Memoized subroutine uses undeclared memory";
+            }
+        }
+    }
+
+    constexpr bool has_calls(const Instruction *code, size_t size) {
+        for (size_t pc = 0; pc < size; ++pc) {
+            if (code[pc].type == CALL)
+                return true;
+        }
+        return false;
+    }
+
+    constexpr void check_subroutines(const Instruction *code, size_t size) {
+        for (size_t pc = 0; pc < size; ++pc) {
+            if (code[pc].type == CALL && code[pc].arg2.value != 0)
+                check_subroutine(code, size, pc);
+        }
+    }
+
+    // Results of memoized subroutines, found by entry and values of the cells and flags before
+    // the call. The oldest results are replaced.
+    template<typename memType>
+    class MemoCache {
+        static constexpr size_t ENTRIES = 64;
+
+        struct Entry {
+            size_t entry = SIZE_MAX;
+            size_t first = 0, count = 0;
+            std::array<memType, MEMO_CELLS> in{}, out{};
+            Flags<memType> in_flags{}, out_flags{};
+        };
+
+        std::array<Entry, ENTRIES> entries{};
+        size_t next = 0;
+        // Entry of the call being recorded and call stack size inside it, 0 if there is none.
+        size_t recorded = 0, depth = 0;
+
+    public:
+        // Applies cached result of a call of entry with cells [first, first + count), which
+        // are valid addresses. Otherwise starts recording the call, depth is call stack size
+        // inside it. Returns true if the result was cached.
+        constexpr bool call(size_t entry, size_t first, size_t count, memType *memory,
+                            Flags<memType> &flags, size_t call_depth) {
+            for (const Entry &e : entries) {
+                if (e.entry != entry || e.first != first || e.count != count ||
+                    e.in_flags.ZF() != flags.ZF() || e.in_flags.SF() != flags.SF())
+                    continue;
+                bool same = true;
+                for (size_t i = 0; i < count && same; ++i)
+                    same = e.in[i] == memory[first + i];
+                if (!same)
+                    continue;
+                for (size_t i = 0; i < count; ++i)
+                    memory[first + i] = e.out[i];
+                flags = e.out_flags;
+                return true;
             }
-        } else if constexpr(Op::type == JS) {
-            // Jump or execute current program.
-            if (env.SF) {
-                Op::template execute<memSize, memType, labels>(env);
+            // Entry is found only when its result is recorded.
+            Entry &e = entries[next];
+            e.entry = SIZE_MAX;
+            e.first = first;
+            e.count = count;
+            for (size_t i = 0; i < count; ++i)
+                e.in[i] = memory[first + i];
+            e.in_flags = flags;
+            recorded = entry;
+            depth = call_depth;
+            return false;
+        }
+
+        // Records result of the call when it returns, call_depth is call stack size before Ret.
+        constexpr void ret(const memType *memory, const Flags<memType> &flags,
+                           size_t call_depth) {
+            if (depth == 0 || depth != call_depth)
+                return;
+            Entry &e = entries[next];
+            for (size_t i = 0; i < e.count; ++i)
+                e.out[i] = memory[e.first + i];
+            e.out_flags = flags;
+            e.entry = recorded;
+            next = (next + 1) % ENTRIES;
+            depth = 0;
+        }
+    };
+
+//-----------------BYTECODE-----------------------
+    // Label helper function, gets Id of Op if it is a label. No Id maps to 0.
+    template<typename Op>
+    constexpr uint64_t label_id() {
+        if constexpr (Op::type == LABEL)
+            return Op::id;
+        else
+            return 0;
+    }
+
+    // Declaration helper, gets Id of Op if it is a variable declaration. No Id maps to 0.
+    template<typename Op>
+    struct variable_id {
+        static constexpr uint64_t value = 0;
+    };
+
+    template<uint64_t id, typename T>
+    struct variable_id<D<id, T>> {
+        static constexpr uint64_t value = id;
+    };
+
+    template<typename... Ops>
+    constexpr size_t count_declarations() {
+        constexpr bool declared[]{false, (variable_id<Ops>::value != 0)...};
+        size_t ans = 0;
+        for (bool decl : declared)
+            ans += decl;
+        return ans;
+    }
+
+    // Gets ids of declared variables, the table has one entry per declaration.
+    template<typename... Ops>
+    constexpr auto declared_ids() {
+        constexpr uint64_t ids[]{0, variable_id<Ops>::value...};
+        std::array<uint64_t, count_declarations<Ops...>()> ans{};
+        size_t count = 0;
+        for (uint64_t id : ids) {
+            if (id != 0)
+                ans[count++] = id;
+        }
+        return ans;
+    }
+
+    // Program lowered to an array of instructions, one per Op.
+    template<typename... Ops>
+    struct Bytecode<Program<Ops...>> {
+        static constexpr size_t size = sizeof...(Ops);
+
+        // Id of every label, 0 for other Ops.
+        static constexpr std::array<uint64_t, size> labels{label_id<Ops>()...};
+
+        // Gets index of first label with id. Otherwise returns size.
+        static constexpr size_t label_address(uint64_t id) {
+            for (size_t i = 0; i < size; ++i) {
+                if (labels[i] == id)
+                    return i;
+            }
+            return size;
+        }
+
+        // Id of every variable, in declaration order.
+        static constexpr auto variables = declared_ids<Ops...>();
+
+        // Gets address of first variable with id, variables are stored in declaration order.
+        // Otherwise returns size.
+        static constexpr size_t variable_address(uint64_t id) {
+            for (size_t addr = 0; addr < variables.size(); ++addr) {
+                if (variables[addr] == id)
+                    return addr;
+            }
+            return size;
+        }
+
+        static constexpr std::array<Instruction, size> decode() {
+            std::array<Instruction, size> code{Ops::template decode<Bytecode>()...};
+            check_subroutines(code.data(), size);
+            return code;
+        }
+    };
+
+    // Loads values of decoded declarations to memory in their order, like load_variables.
+    template<typename memType, size_t memSize>
+    void load_declarations(const Instruction *code, size_t size, memType *memory) {
+        size_t var_count = 0;
+        for (size_t pc = 0; pc < size; ++pc) {
+            if (code[pc].type != DECL)
+                continue;
+            if (var_count == memSize)
+                throw "Not enough memory for variables";
+            memory[var_count++] = static_cast<memType>(code[pc].arg2.value);
+        }
+    }
+
+//-----------------PEEPHOLE-----------------------
+    // Decoded program after optimize, instructions past length are unused.
+    template<size_t size>
+    struct OptimizedCode {
+        std::array<Instruction, size> code{};
+        size_t length = 0;
+    };
+
+    // Optimizes a decoded program within blocks between labels, so memory and flags are
+    // the same whenever a label is reached and when the program ends:
+    // - labels and declarations are dropped, jumps go to the next instruction instead,
+    // - Mem operands of cells with known values are replaced by the values,
+    // - Inc, Dec, Add and Sub of a constant on a cell are fused with earlier ones,
+    // - they become a Mov of a constant if their flags are not read,
+    // - Mov overwritten by a later Mov to the same cell is dropped,
+    // - Cmp whose flags are not read is dropped.
+    // Instructions are moved only past ones which cannot report errors and do not use
+    // the same cell, and only such instructions are removed. Memory is zeroed and
+    // variables are loaded before the program starts, so values of cells are known
+    // until the first label.
+    template<typename memType, size_t memSize, size_t size>
+    class Peephole {
+        // Cells with values known in the current block, more are forgotten.
+        static constexpr size_t KNOWN_CELLS = 16;
+        // Instructions looked back at to find the last write of a cell.
+        static constexpr size_t WINDOW = 8;
+
+        struct Cell {
+            uint64_t addr = 0;
+            memType value = 0;
+            bool known = false;
+        };
+
+        const std::array<Instruction, size> &code;
+        OptimizedCode<size> ans{};
+        // Flags may be read after instruction i.
+        std::array<bool, size> zf_live{}, sf_live{};
+        std::array<uint64_t, size> variables{};
+        size_t var_count = 0;
+        std::array<Cell, KNOWN_CELLS> cells{};
+        size_t cell_count = 0;
+        // Cells which are not in cells have initial values, true until the first label.
+        bool initial = true;
+        // Instructions before block cannot be changed.
+        size_t block = 0;
+
+        static constexpr bool is_cell(const Operand &op) {
+            return op.kind != REG && op.depth == 1 &&
+                   valid_address<memType, memSize>(op.value, op.negative);
+        }
+
+        // Operand which is read without errors. Registers are not tracked, they are only
+        // not memory cells.
+        static constexpr bool is_constant(const Operand &op) {
+            return op.depth == 0 || is_cell(op) || is_register(op);
+        }
+
+        static constexpr Operand number(memType val) {
+            return {NUM, static_cast<uint64_t>(val), is_negative(val), 0};
+        }
+
+        // Gets value added to the cell by Add, Sub, Inc or Dec with a constant, false if ins
+        // is not such instruction.
+        static constexpr bool cell_delta(const Instruction &ins, uint64_t &delta) {
+            if (!is_cell(ins.arg1))
+                return false;
+            switch (ins.type) {
+                case INC:
+                    delta = 1;
+                    return true;
+                case DEC:
+                    delta = static_cast<uint64_t>(-1);
+                    return true;
+                case ADD:
+                case SUB:
+                    if (ins.arg2.depth != 0)
+                        return false;
+                    delta = ins.type == ADD ? ins.arg2.value : -ins.arg2.value;
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        static constexpr bool is_jump(OpType type) {
+            return type == JMP || type == JZ || type == JS;
+        }
+
+        constexpr bool value(uint64_t addr, memType &val) const {
+            for (size_t i = 0; i < cell_count; ++i) {
+                if (cells[i].addr == addr) {
+                    val = cells[i].value;
+                    return cells[i].known;
+                }
+            }
+            if (!initial)
+                return false;
+            val = addr < var_count ? static_cast<memType>(variables[addr]) : 0;
+            return true;
+        }
+
+        constexpr void set(uint64_t addr, bool known, memType val) {
+            for (size_t i = 0; i < cell_count; ++i) {
+                if (cells[i].addr == addr) {
+                    cells[i] = {addr, val, known};
+                    return;
+                }
+            }
+            if (cell_count == KNOWN_CELLS)
+                forget();
+            cells[cell_count++] = {addr, val, known};
+        }
+
+        constexpr void forget() {
+            cell_count = 0;
+            initial = false;
+        }
+
+        // Replaces Mem<Mem<...>> of known cells with a shorter one, and pvalue of a known cell
+        // with its value. Invalid addresses are kept to be reported.
+        constexpr void resolve(Operand &op, bool pvalue) const {
+            memType val = 0;
+            while (op.kind != REG && op.depth > 1 &&
+                   valid_address<memType, memSize>(op.value, op.negative) &&
+                   value(op.value, val) &&
+                   valid_address<memType, memSize>(static_cast<uint64_t>(val),
+                                                   is_negative(val))) {
+                op = {NUM, static_cast<uint64_t>(val), false, op.depth - 1};
+            }
+            if (pvalue && is_cell(op) && value(op.value, val))
+                op = number(val);
+        }
+
+        // Records how the instruction changes known cells.
+        constexpr void update(const Instruction &ins) {
+            if (ins.type == CMP || is_jump(ins.type) || is_register(ins.arg1))
+                return;
+            if (!is_cell(ins.arg1)) {
+                // Any cell may be written.
+                forget();
+                return;
+            }
+            memType val = 0;
+            uint64_t delta = 0;
+            if (ins.type == MOV && ins.arg2.depth == 0) {
+                set(ins.arg1.value, true, static_cast<memType>(ins.arg2.value));
+            } else if (cell_delta(ins, delta) && value(ins.arg1.value, val)) {
+                set(ins.arg1.value, true,
+                    static_cast<memType>(static_cast<uint64_t>(val) + delta));
             } else {
-                Program<Ops...>::template run<memSize, memType, labels>(env);
+                set(ins.arg1.value, false, 0);
             }
-        } else if constexpr(Op::type == DECL || Op::type == LABEL) {
-            // Skip these instructions.
-            Program<Ops...>::template run<memSize, memType, labels>(env);
-        } else {
-            Op::template execute<memSize, memType>(env);
-            Program<Ops...>::template run<memSize, memType, labels>(env);
         }
+
+        // Instruction which can be moved over by a write to the cell at addr.
+        static constexpr bool independent(const Instruction &ins, uint64_t addr) {
+            if (is_jump(ins.type) || !is_constant(ins.arg1) || !is_constant(ins.arg2))
+                return false;
+            return !(is_cell(ins.arg1) && ins.arg1.value == addr) &&
+                   !(is_cell(ins.arg2) && ins.arg2.value == addr);
+        }
+
+        // Gets index of the last write to the cell at addr in the block, which is followed
+        // only by independent instructions. Otherwise returns length.
+        constexpr size_t last_write(uint64_t addr) const {
+            const size_t length = ans.length;
+            for (size_t j = length, looked = 0; j > block && looked < WINDOW; ++looked) {
+                const Instruction &prev = ans.code[--j];
+                if (prev.type != CMP && !is_jump(prev.type) && is_cell(prev.arg1) &&
+                    prev.arg1.value == addr)
+                    return j;
+                if (!independent(prev, addr))
+                    return length;
+            }
+            return length;
+        }
+
+        constexpr void remove(size_t j) {
+            for (size_t k = j; k + 1 < ans.length; ++k)
+                ans.code[k] = ans.code[k + 1];
+            --ans.length;
+        }
+
+        constexpr void emit(const Instruction &ins) {
+            ans.code[ans.length++] = ins;
+            update(ins);
+        }
+
+        constexpr void step(Instruction ins, bool flags_dead) {
+            resolve(ins.arg1, ins.type == CMP);
+            resolve(ins.arg2, true);
+            if (ins.type == CMP && flags_dead && is_constant(ins.arg1) &&
+                is_constant(ins.arg2))
+                return;
+
+            memType val = 0;
+            uint64_t delta = 0, prev_delta = 0;
+            if (cell_delta(ins, delta)) {
+                uint64_t addr = ins.arg1.value;
+                if (flags_dead && value(addr, val)) {
+                    ins = {MOV, ins.arg1,
+                           number(static_cast<memType>(static_cast<uint64_t>(val) + delta))};
+                } else {
+                    size_t j = last_write(addr);
+                    if (j == ans.length) {
+                        emit(ins);
+                        return;
+                    }
+                    Instruction &prev = ans.code[j];
+                    if (cell_delta(prev, prev_delta)) {
+                        // Flags of prev are not read before ins sets them.
+                        remove(j);
+                        emit({ADD, ins.arg1, {NUM, prev_delta + delta}});
+                    } else if (flags_dead && prev.type == MOV && prev.arg2.depth == 0) {
+                        update(ins);
+                        prev.arg2 = number(static_cast<memType>(prev.arg2.value + delta));
+                    } else {
+                        emit(ins);
+                    }
+                    return;
+                }
+            }
+            if (ins.type == MOV && is_cell(ins.arg1) && is_constant(ins.arg2) &&
+                !(is_cell(ins.arg2) && ins.arg2.value == ins.arg1.value)) {
+                size_t j = last_write(ins.arg1.value);
+                if (j != ans.length && ans.code[j].type == MOV &&
+                    is_constant(ans.code[j].arg2))
+                    remove(j);
+            }
+            emit(ins);
+        }
+
+    public:
+        constexpr explicit Peephole(const std::array<Instruction, size> &code) : code(code) {
+            // Labels may be reached from jumps, so flags are read there, at the end they
+            // are not.
+            bool zf = false, sf = false;
+            for (size_t i = size; i-- > 0;) {
+                zf_live[i] = zf;
+                sf_live[i] = sf;
+                switch (code[i].type) {
+                    case LABEL:
+                    case JMP:
+                    case JZ:
+                    case JS:
+                    case CALL:
+                    case RET:
+                        zf = sf = true;
+                        break;
+                    case HLT:
+                        zf = sf = false;
+                        break;
+                    case ADD:
+                    case SUB:
+                    case INC:
+                    case DEC:
+                    case CMP:
+                    case CMPRANGE:
+                    case XADD:
+                    case CMPXCHG:
+                        zf = sf = false;
+                        break;
+                    case AND:
+                    case OR:
+                    case NOT:
+                    case IN:
+                        zf = false;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            for (size_t i = 0; i < size; ++i) {
+                if (code[i].type == DECL)
+                    variables[var_count++] = code[i].arg2.value;
+            }
+        }
+
+        constexpr OptimizedCode<size> optimize() {
+            // index[i] = instruction executed after jumping to i.
+            std::array<size_t, size + 1> index{};
+            for (size_t i = 0; i < size; ++i) {
+                index[i] = ans.length;
+                const Instruction &ins = code[i];
+                if (ins.type == LABEL) {
+                    block = ans.length;
+                    forget();
+                } else if (is_jump(ins.type)) {
+                    ans.code[ans.length++] = ins;
+                } else if (ins.type == CALL || ins.type == RET || ins.type == HLT) {
+                    // Subroutines change memory, the next instruction is reached by Ret.
+                    ans.code[ans.length++] = ins;
+                    block = ans.length;
+                    forget();
+                } else if (is_block(ins.type)) {
+                    // Blocks may cover any cell, writes are not moved over them.
+                    Instruction resolved = ins;
+                    resolve(resolved.arg1, false);
+                    resolve(resolved.arg2, ins.type == FILL);
+                    resolve(resolved.arg3, true);
+                    ans.code[ans.length++] = resolved;
+                    block = ans.length;
+                    if (ins.type != CMPRANGE)
+                        forget();
+                } else if (is_port(ins.type)) {
+                    // Order of reads and writes of ports is kept, In forgets what it writes.
+                    Instruction resolved = ins;
+                    resolve(resolved.arg1, ins.type == OUT);
+                    resolve(resolved.arg2, true);
+                    emit(resolved);
+                    block = ans.length;
+                } else if (is_atomic(ins.type)) {
+                    // Other cores may change any cell, memory accesses are not moved over
+                    // atomic instructions.
+                    ans.code[ans.length++] = ins;
+                    block = ans.length;
+                    forget();
+                } else if (ins.type != DECL) {
+                    step(ins, !zf_live[i] && !sf_live[i]);
+                }
+            }
+            index[size] = ans.length;
+
+            for (size_t i = 0; i < ans.length; ++i) {
+                if (is_jump(ans.code[i].type) || ans.code[i].type == CALL)
+                    ans.code[i].target = index[ans.code[i].target];
+            }
+            return ans;
+        }
+
+        // Replaces counted loops of optimized code
+        //     h: body; Dec c; Jz exit; Jmp h
+        // with LOOP c, exit followed by the body, if nothing else jumps into the loop and the
+        // body only adds constants or cells not written in the loop to cells other than c.
+        // LOOP adds the body c times at once (the loop runs c times modulo the word size), then
+        // sets c to 0, flags like the last Dec did and jumps to exit.
+        static constexpr OptimizedCode<size> fold_loops(OptimizedCode<size> ans) {
+            for (size_t j = 2; j < ans.length; ++j) {
+                const Instruction &jmp = ans.code[j], &jz = ans.code[j - 1];
+                const Instruction &dec = ans.code[j - 2];
+                if (jmp.type != JMP || jmp.target > j - 2 || jz.type != JZ ||
+                    dec.type != DEC || !is_cell(dec.arg1) || !counted_loop(ans, jmp.target, j))
+                    continue;
+
+                size_t head = jmp.target;
+                Instruction loop{LOOP, dec.arg1, {NUM, j - 2 - head}, jz.target};
+                for (size_t k = j - 2; k > head; --k)
+                    ans.code[k] = ans.code[k - 1];
+                // Dec, Jz and Jmp are left unreachable after the body.
+                ans.code[head] = loop;
+            }
+            return ans;
+        }
+
+    private:
+        static constexpr bool counted_loop(const OptimizedCode<size> &ans, size_t head,
+                                           size_t end) {
+            const uint64_t counter = ans.code[end - 2].arg1.value;
+            auto written = [&](uint64_t addr) {
+                if (addr == counter)
+                    return true;
+                for (size_t k = head; k < end - 2; ++k) {
+                    if (ans.code[k].arg1.value == addr)
+                        return true;
+                }
+                return false;
+            };
+            for (size_t k = head; k < end - 2; ++k) {
+                const Instruction &ins = ans.code[k];
+                if (ins.type != ADD && ins.type != SUB && ins.type != INC && ins.type != DEC)
+                    return false;
+                if (!is_cell(ins.arg1) || ins.arg1.value == counter)
+                    return false;
+                if ((ins.type == ADD || ins.type == SUB) && ins.arg2.depth != 0 &&
+                    (!is_cell(ins.arg2) || written(ins.arg2.value)))
+                    return false;
+            }
+            for (size_t i = 0; i < ans.length; ++i) {
+                const Instruction &ins = ans.code[i];
+                if ((is_jump(ins.type) || ins.type == CALL) && ins.target > head &&
+                    ins.target <= end)
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    template<typename memType, size_t memSize, size_t size>
+    constexpr OptimizedCode<size> optimize(const std::array<Instruction, size> &code) {
+        return Peephole<memType, memSize, size>(code).optimize();
     }
-};
 
-// Base case
-template<typename Op>
-struct Program<Op> {
+    template<typename memType, size_t memSize, size_t size>
+    constexpr OptimizedCode<size> fold_loops(const OptimizedCode<size> &code) {
+        return Peephole<memType, memSize, size>::fold_loops(code);
+    }
 
-    static constexpr void check_program() {
-        Op::check();
+    // Finalizer of splitmix64.
+    constexpr uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+        return x ^ (x >> 31);
     }
 
-    template<size_t memSize, typename memType, size_t var_count>
-    static constexpr void load_variables(Env<memType, memSize> &env) {
-        if constexpr (Op::type == DECL) {
-            static_assert(Op::valid);
-            Op::template load_variable<memSize, memType, var_count>(env);
-            // This is last recursion call so I can set number of variables to env.
-            env.variables_cnt = var_count + 1;
-        } else {
-            env.variables_cnt = var_count;
+    // Detects programs which never halt: hashes memory, registers, flags, return addresses,
+    // positions of inputs and pc after backward jumps, as every cycle has one. Memory hash is
+    // a sum of hashes of cells (registers are cells after memory), so it is updated on every
+    // write. Values written to outputs are not a part of the state. A state is saved
+    // after 1, 2, 4, ... backward jumps (Brent's algorithm), so a cycle is found after at most
+    // twice as many jumps as reach and go around it. Hashes have 64 bits, a collision would be
+    // reported as a cycle.
+    template<typename memType, size_t memSize>
+    class CycleDetector {
+        uint64_t saved = 0, memory_hash = 0, calls_hash = 0, inputs_hash = 0;
+        // Backward jumps since the state was saved and before it is saved again.
+        size_t count = 0, power = 1;
+
+        static constexpr uint64_t cell(size_t addr, memType val) {
+            return mix(static_cast<uint64_t>(val) ^ addr * 0x9E3779B97F4A7C15);
+        }
+
+    public:
+        // Id of the label of the last taken jump.
+        uint64_t label = 0;
+        bool repeated = false;
+
+        constexpr void rehash(const memType *memory, const memType *registers) {
+            memory_hash = 0;
+            for (size_t addr = 0; addr < memSize; ++addr)
+                memory_hash += cell(addr, memory[addr]);
+            for (size_t reg = 0; reg < REGISTERS; ++reg)
+                memory_hash += cell(memSize + reg, registers[reg]);
+        }
+
+        constexpr void write(size_t addr, memType before, memType after) {
+            memory_hash += cell(addr, after) - cell(addr, before);
+        }
+
+        // Call stack had depth return addresses before push or after pop.
+        constexpr void call(size_t depth, size_t pc, bool push) {
+            uint64_t hash = mix(mix(depth) + pc);
+            calls_hash += push ? hash : -hash;
+        }
+
+        // A value was read from port.
+        constexpr void read(size_t port) {
+            inputs_hash += mix(port + 1);
+        }
+
+        // Records the state after a jump to label, returns true if it repeats the saved one.
+        constexpr bool jump(uint64_t jump_label, size_t from, size_t pc,
+                            const Flags<memType> &flags) {
+            label = jump_label;
+            if (pc > from)
+                return false;
+            uint64_t hash = memory_hash + inputs_hash +
+                            mix(calls_hash + (pc << 2 | flags.ZF() << 1 | flags.SF()));
+            if (power > 1 && hash == saved)
+                return repeated = true;
+            if (++count == power) {
+                saved = hash;
+                count = 0;
+                power *= 2;
+            }
+            return false;
+        }
+    };
+
+    // Execution counters indexed by instruction, updated when profiling.
+    struct Counters {
+        size_t *counts = nullptr;
+        size_t *taken = nullptr, *not_taken = nullptr;
+    };
+
+    // Executes instructions one after another from pc until it leaves the program or steps
+    // instructions (labels and declarations are not counted) are executed, returns pc of the
+    // next instruction.
+    // Jumps only change pc, so call depth does not depend on executed instructions count.
+    // Return addresses are kept in calls, or in a new stack if it is null, the same for ports.
+    // When watching, stops after a taken jump which repeats a state seen by cycles.
+    template<typename memType, size_t memSize, bool profiling = false, bool watching = false>
+    constexpr size_t execute(Memory<memType, memSize> memory, Flags<memType> &flags,
+                             const Instruction *code, size_t size, Counters counters = {},
+                             size_t pc = 0, size_t steps = SIZE_MAX,
+                             CallStack *calls = nullptr,
+                             CycleDetector<memType, memSize> *cycles = nullptr,
+                             Ports<memType> *ports = nullptr) {
+        CallStack own_calls;
+        CallStack &stack = calls ? *calls : own_calls;
+        Ports<memType> own_ports;
+        Ports<memType> &io = ports ? *ports : own_ports;
+        MemoCache<memType> memo;
+        // Cell written by the instruction, its address (registers follow memory) and value
+        // before, when watching.
+        memType *written = nullptr;
+        size_t written_address = 0;
+        memType before = 0;
+        auto watch = [&](const Operand &op, memType &cell) {
+            if constexpr (watching) {
+                written = &cell;
+                written_address = is_register(op) ? memSize + static_cast<size_t>(op.value) :
+                                  static_cast<size_t>(&cell - memory.cells);
+                before = cell;
+            }
+        };
+        auto lvalue = [&](const Operand &op) -> memType & {
+            memType &cell = memory.lvalue(op);
+            watch(op, cell);
+            return cell;
+        };
+        auto record_write = [&] {
+            if constexpr (watching) {
+                if (written) {
+                    cycles->write(written_address, before, *written);
+                    written = nullptr;
+                }
+            }
+        };
+        auto store = [&](size_t addr, memType val) {
+            if constexpr (watching)
+                cycles->write(addr, memory.cells[addr], val);
+            memory.cells[addr] = val;
+        };
+        auto jump = [&](const Instruction &ins) {
+            size_t from = pc - 1;
+            pc = ins.target;
+            if constexpr (watching)
+                return cycles->jump(ins.arg1.value, from, pc, flags);
+            return false;
+        };
+        while (pc < size && (steps > 0 || code[pc].type == LABEL || code[pc].type == DECL)) {
+            if constexpr (profiling)
+                ++counters.counts[pc];
+            const Instruction &ins = code[pc++];
+            switch (ins.type) {
+                case MOV:
+                    lvalue(ins.arg1) = memory.pvalue(ins.arg2);
+                    break;
+                case ADD: {
+                    memType &lval = lvalue(ins.arg1);
+                    lval += memory.pvalue(ins.arg2);
+                    flags.update_flags(lval);
+                    break;
+                }
+                case SUB: {
+                    memType &lval = lvalue(ins.arg1);
+                    lval -= memory.pvalue(ins.arg2);
+                    flags.update_flags(lval);
+                    break;
+                }
+                case CMP:
+                    flags.update_flags(memory.pvalue(ins.arg1) - memory.pvalue(ins.arg2));
+                    break;
+                case FILL: {
+                    size_t dst = memory.address(ins.arg1);
+                    size_t len = memory.length(dst, ins.arg3);
+                    memType val = memory.pvalue(ins.arg2);
+                    for (size_t i = 0; i < len; ++i)
+                        store(dst + i, val);
+                    break;
+                }
+                case COPY: {
+                    size_t dst = memory.address(ins.arg1), src = memory.address(ins.arg2);
+                    // Checking the block starting later is enough.
+                    size_t len = memory.length(dst > src ? dst : src, ins.arg3);
+                    // Like memmove, cells are read before they are overwritten.
+                    if (dst < src) {
+                        for (size_t i = 0; i < len; ++i)
+                            store(dst + i, memory.cells[src + i]);
+                    } else if (dst > src) {
+                        for (size_t i = len; i-- > 0;)
+                            store(dst + i, memory.cells[src + i]);
+                    }
+                    break;
+                }
+                case CMPRANGE: {
+                    size_t a = memory.address(ins.arg1), b = memory.address(ins.arg2);
+                    size_t len = memory.length(a > b ? a : b, ins.arg3);
+                    size_t i = 0;
+                    while (i < len && memory.cells[a + i] == memory.cells[b + i])
+                        ++i;
+                    flags.update_flags(i < len ? memory.cells[a + i] - memory.cells[b + i] : 0);
+                    break;
+                }
+                case INC: {
+                    memType &lval = lvalue(ins.arg1);
+                    lval += 1;
+                    flags.update_flags(lval);
+                    break;
+                }
+                case DEC: {
+                    memType &lval = lvalue(ins.arg1);
+                    lval -= 1;
+                    flags.update_flags(lval);
+                    break;
+                }
+                case AND: {
+                    memType &lval = lvalue(ins.arg1);
+                    lval &= memory.pvalue(ins.arg2);
+                    flags.update_zero(lval);
+                    break;
+                }
+                case OR: {
+                    memType &lval = lvalue(ins.arg1);
+                    lval |= memory.pvalue(ins.arg2);
+                    flags.update_zero(lval);
+                    break;
+                }
+                case NOT: {
+                    memType &lval = lvalue(ins.arg1);
+                    lval = ~lval;
+                    flags.update_zero(lval);
+                    break;
+                }
+                case IN: {
+                    size_t port = io.port(memory.pvalue(ins.arg2));
+                    memType &lval = lvalue(ins.arg1);
+                    memType val = 0;
+                    bool read = io.read(port, val);
+                    lval = val;
+                    flags.update_zero(read);
+                    if constexpr (watching) {
+                        if (read)
+                            cycles->read(port);
+                    }
+                    break;
+                }
+                case OUT:
+                    io.write(io.port(memory.pvalue(ins.arg1)), memory.pvalue(ins.arg2));
+                    break;
+                // A single core, atomic instructions need no synchronization.
+                case XADD: {
+                    memType &src = memory.lvalue(ins.arg2);
+                    memType &dst = lvalue(ins.arg1);
+                    memType old = dst;
+                    dst += src;
+                    flags.update_flags(dst);
+                    // Dst is written last, like by the atomic addition.
+                    if (&src != &dst) {
+                        record_write();
+                        watch(ins.arg2, src);
+                        src = old;
+                    }
+                    break;
+                }
+                case CMPXCHG: {
+                    memType &expected = memory.lvalue(ins.arg2);
+                    memType val = memory.pvalue(ins.arg3);
+                    memType &dst = lvalue(ins.arg1);
+                    memType old = dst;
+                    flags.update_flags(expected - old);
+                    if (old == expected) {
+                        dst = val;
+                    } else {
+                        watch(ins.arg2, expected);
+                        expected = old;
+                    }
+                    break;
+                }
+                case FENCE:
+                    break;
+                case JMP:
+                    if (jump(ins))
+                        return pc;
+                    break;
+                case CALL:
+                    if (ins.arg2.value != 0) {
+                        size_t first = static_cast<size_t>(ins.arg1.value);
+                        if (memo.call(ins.target, first, ins.arg2.value, memory.cells, flags,
+                                      stack.size + 1)) {
+                            if constexpr (watching)
+                                cycles->rehash(memory.cells, memory.registers);
+                            break;
+                        }
+                    }
+                    if constexpr (watching)
+                        cycles->call(stack.size, pc, true);
+                    stack.push(pc);
+                    pc = ins.target;
+                    break;
+                case RET:
+                    pc = stack.pop();
+                    if constexpr (watching)
+                        cycles->call(stack.size, pc, false);
+                    memo.ret(memory.cells, flags, stack.size + 1);
+                    break;
+                case HLT:
+                    return size;
+                case LOOP: {
+                    // Body follows, every instruction adds a constant counter times.
+                    uint64_t times = static_cast<typename std::make_unsigned<memType>::type>(
+                            memory.pvalue(ins.arg1));
+                    for (size_t end = pc + ins.arg2.value; pc < end; ++pc) {
+                        const Instruction &body = code[pc];
+                        uint64_t delta = body.type == INC ? 1 : body.type == DEC ? -1 :
+                                         static_cast<uint64_t>(memory.pvalue(body.arg2));
+                        if (body.type == SUB)
+                            delta = -delta;
+                        memType &lval = lvalue(body.arg1);
+                        lval = static_cast<memType>(static_cast<uint64_t>(lval) + times * delta);
+                        record_write();
+                    }
+                    lvalue(ins.arg1) = 0;
+                    flags.update_flags(0);
+                    pc = ins.target;
+                    break;
+                }
+                case JZ:
+                case JS: {
+                    bool taken = ins.type == JZ ? flags.ZF() : flags.SF();
+                    if constexpr (profiling)
+                        ++(taken ? counters.taken : counters.not_taken)[pc - 1];
+                    if (taken && jump(ins))
+                        return pc;
+                    break;
+                }
+                default:
+                    // Labels and declarations are not executed.
+                    continue;
+            }
+            record_write();
+            --steps;
         }
+        return pc;
     }
 
-    template<size_t memSize, typename memType, typename labels>
-    static constexpr void run(Env<memType, memSize> &env) {
-        if constexpr(Op::type == JZ) {
-            if (env.ZF) {
-                Op::template execute<memSize, memType, labels>(env);
+//-----------------THREADED CODE------------------
+// Handlers of threaded code, one for every instruction and operand kinds combination:
+// IMM - Num or Lea, DIR - Mem of a constant address, IND - Mem of a memory cell or a register,
+// REG - register.
+#define TMPASM_BINARY_HANDLERS(X, op) \
+    X(op, DIR, IMM) X(op, DIR, DIR) X(op, DIR, IND) X(op, DIR, REG) \
+    X(op, IND, IMM) X(op, IND, DIR) X(op, IND, IND) X(op, IND, REG) \
+    X(op, REG, IMM) X(op, REG, DIR) X(op, REG, IND) X(op, REG, REG)
+
+#define TMPASM_HANDLERS(X) \
+    TMPASM_BINARY_HANDLERS(X, MOV) TMPASM_BINARY_HANDLERS(X, ADD) \
+    TMPASM_BINARY_HANDLERS(X, SUB) TMPASM_BINARY_HANDLERS(X, AND) \
+    TMPASM_BINARY_HANDLERS(X, OR) \
+    X(CMP, IMM, IMM) X(CMP, IMM, DIR) X(CMP, IMM, IND) X(CMP, IMM, REG) \
+    X(CMP, DIR, IMM) X(CMP, DIR, DIR) X(CMP, DIR, IND) X(CMP, DIR, REG) \
+    X(CMP, IND, IMM) X(CMP, IND, DIR) X(CMP, IND, IND) X(CMP, IND, REG) \
+    X(CMP, REG, IMM) X(CMP, REG, DIR) X(CMP, REG, IND) X(CMP, REG, REG) \
+    X(INC, DIR, IMM) X(INC, IND, IMM) X(INC, REG, IMM) \
+    X(DEC, DIR, IMM) X(DEC, IND, IMM) X(DEC, REG, IMM) \
+    X(NOT, DIR, IMM) X(NOT, IND, IMM) X(NOT, REG, IMM)
+
+#define TMPASM_HANDLER_NAME(op, kind1, kind2) op##_##kind1##_##kind2,
+
+// GNU computed goto jumps straight to the next handler, switch is the portable fallback.
+#ifndef TMPASM_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define TMPASM_COMPUTED_GOTO 1
+#else
+#define TMPASM_COMPUTED_GOTO 0
+#endif
+#endif
+
+// Labels of ops belong to the untraced instantiation of execute, traced one looks handlers up.
+#if TMPASM_COMPUTED_GOTO
+#define TMPASM_CASE(name) name:
+#define TMPASM_DISPATCH() goto *(Tracer::enabled ? handler_labels[ip->handler] : ip->label)
+#else
+#define TMPASM_CASE(name) case name:
+#define TMPASM_DISPATCH() continue
+#endif
+
+// GCC merges equal ends of handlers, so most of them would share a few indirect jumps, which
+// predict worse than one jump per handler.
+#if TMPASM_COMPUTED_GOTO && defined(__GNUC__) && !defined(__clang__)
+#define TMPASM_NO_CROSSJUMPING __attribute__((optimize("no-crossjumping")))
+#else
+#define TMPASM_NO_CROSSJUMPING
+#endif
+
+#define TMPASM_STEP_HANDLER(op, kind1, kind2) \
+    TMPASM_CASE(op##_##kind1##_##kind2) \
+        if constexpr (Tracer::enabled) \
+            traced_step<op, kind1, kind2>(*ip, memory, registers, flags, *tracer, ip - code); \
+        else \
+            step<op, kind1, kind2>(*ip, memory, registers, flags); \
+        ++ip; \
+        TMPASM_DISPATCH();
+
+    // Tracer of untraced execution. A tracer gets every executed op, with cells it wrote:
+    //     record(op, flags) or record(op, flags, address, old value, new value, first write)
+    struct NoTracer {
+        static constexpr bool enabled = false;
+    };
+
+    // Program prepared for fast runtime execution. Labels and declarations are dropped,
+    // operands are decoded to their kind and constant addresses are checked once, on load.
+    template<typename memType, size_t memSize>
+    class ThreadedCode {
+        enum Kind {
+            IMM, DIR, IND, REG
+        };
+
+        enum Handler {
+            TMPASM_HANDLERS(TMPASM_HANDLER_NAME)
+            JUMP, JUMP_Z, JUMP_S, SUBROUTINE, RETURN, BLOCK, PORT, ATOMIC, HALT, FAULT
+        };
+
+        struct Op {
+            Handler handler = HALT;
+            // IND operand starts at the address in register arg.
+            bool indirect1 = false, indirect2 = false;
+            const void *label = nullptr;
+            // Value of IMM, register of REG, otherwise address of first memory access.
+            uint64_t arg1 = 0, arg2 = 0;
+            size_t depth1 = 0, depth2 = 0;
+            size_t target = 0;
+            const char *fault = nullptr;
+        };
+
+        // Call stack and memoized results, allocated only for programs with calls.
+        struct Calls {
+            CallStack stack;
+            MemoCache<memType> memo;
+        };
+
+        std::vector<Op> ops;
+        // Instruction of every op.
+        std::vector<size_t> pcs;
+        // Block, port and atomic instructions, indexed by target of their ops.
+        std::vector<Instruction> blocks;
+        bool has_calls = false;
+
+        // Follows Mem<Mem<...>> chain from a constant address, or from a register.
+        static size_t indirect(const memType *memory, const memType *registers, size_t addr,
+                               size_t depth, bool from_register) {
+            const memType *cells = from_register ? registers : memory;
+            for (size_t i = 1; i < depth; ++i) {
+                memType val = cells[addr];
+                addr = check_address<memType, memSize>(val, is_negative(val));
+                cells = memory;
+            }
+            return addr;
+        }
+
+        template<Kind kind>
+        static memType pvalue(const memType *memory, const memType *registers, uint64_t arg,
+                              size_t depth, bool from_register) {
+            if constexpr (kind == IMM)
+                return static_cast<memType>(arg);
+            else if constexpr (kind == DIR)
+                return memory[arg];
+            else if constexpr (kind == REG)
+                return registers[arg];
+            else
+                return memory[indirect(memory, registers, arg, depth, from_register)];
+        }
+
+        template<Kind kind>
+        static memType &lvalue(memType *memory, memType *registers, uint64_t arg, size_t depth,
+                               bool from_register) {
+            if constexpr (kind == DIR)
+                return memory[arg];
+            else if constexpr (kind == REG)
+                return registers[arg];
+            else
+                return memory[indirect(memory, registers, arg, depth, from_register)];
+        }
+
+        // Gets value of the second operand of op.
+        template<Kind kind>
+        static memType pvalue2(const Op &op, const memType *memory, const memType *registers) {
+            return pvalue<kind>(memory, registers, op.arg2, op.depth2, op.indirect2);
+        }
+
+        // Executes a writing instruction on its lvalue.
+        template<OpType type, Kind kind2>
+        static void apply(memType &lval, const Op &op, const memType *memory,
+                          const memType *registers, Flags<memType> &flags) {
+            if constexpr (type == MOV) {
+                lval = pvalue2<kind2>(op, memory, registers);
+            } else if constexpr (type == ADD) {
+                lval += pvalue2<kind2>(op, memory, registers);
+                flags.update_flags(lval);
+            } else if constexpr (type == SUB) {
+                lval -= pvalue2<kind2>(op, memory, registers);
+                flags.update_flags(lval);
+            } else if constexpr (type == AND) {
+                lval &= pvalue2<kind2>(op, memory, registers);
+                flags.update_zero(lval);
+            } else if constexpr (type == OR) {
+                lval |= pvalue2<kind2>(op, memory, registers);
+                flags.update_zero(lval);
+            } else if constexpr (type == INC) {
+                lval += 1;
+                flags.update_flags(lval);
+            } else if constexpr (type == DEC) {
+                lval -= 1;
+                flags.update_flags(lval);
+            } else {
+                lval = ~lval;
+                flags.update_zero(lval);
+            }
+        }
+
+        // Executes a non-jump instruction, specialized for its operand kinds.
+        template<OpType type, Kind kind1, Kind kind2>
+        static void step(const Op &op, memType *memory, memType *registers,
+                         Flags<memType> &flags) {
+            if constexpr (type == CMP) {
+                flags.update_flags(
+                        pvalue<kind1>(memory, registers, op.arg1, op.depth1, op.indirect1) -
+                        pvalue2<kind2>(op, memory, registers));
+            } else {
+                apply<type, kind2>(
+                        lvalue<kind1>(memory, registers, op.arg1, op.depth1, op.indirect1), op,
+                        memory, registers, flags);
+            }
+        }
+
+        // Registers are traced as cells after memory.
+        template<OpType type, Kind kind1, Kind kind2, typename Tracer>
+        static void traced_step(const Op &op, memType *memory, memType *registers,
+                                Flags<memType> &flags, Tracer &tracer, size_t index) {
+            if constexpr (type == CMP) {
+                step<type, kind1, kind2>(op, memory, registers, flags);
+                tracer.record(index, flags);
+            } else {
+                memType &lval =
+                    lvalue<kind1>(memory, registers, op.arg1, op.depth1, op.indirect1);
+                memType old = lval;
+                apply<type, kind2>(lval, op, memory, registers, flags);
+                size_t address = kind1 == REG ? memSize + static_cast<size_t>(op.arg1) :
+                                 static_cast<size_t>(&lval - memory);
+                tracer.record(index, flags, address, old, lval, true);
+            }
+        }
+
+        // Records writes of an op to len cells from addr, which had values before.
+        template<typename Tracer>
+        static void record_writes(Tracer &tracer, size_t index, const Flags<memType> &flags,
+                                  const memType *memory, size_t addr, const memType *before,
+                                  size_t len) {
+            bool first = true;
+            for (size_t i = 0; i < len; ++i) {
+                if (before[i] != memory[addr + i]) {
+                    tracer.record(index, flags, addr + i, before[i], memory[addr + i], first);
+                    first = false;
+                }
+            }
+            if (first)
+                tracer.record(index, flags);
+        }
+
+        // Compares cells in chunks, which the compiler turns into vector compares.
+        static void compare(const memType *a, const memType *b, size_t len,
+                            Flags<memType> &flags) {
+            constexpr size_t CHUNK = 64 / sizeof(memType);
+            size_t i = 0;
+            for (; i + CHUNK <= len; i += CHUNK) {
+                memType diff = 0;
+                for (size_t j = 0; j < CHUNK; ++j)
+                    diff |= static_cast<memType>(a[i + j] ^ b[i + j]);
+                if (diff != 0)
+                    break;
+            }
+            while (i < len && a[i] == b[i])
+                ++i;
+            flags.update_flags(i < len ? a[i] - b[i] : 0);
+        }
+
+        // Executes a block instruction, with the same checks as execute.
+        static void block(const Instruction &ins, memType *cells, memType *registers,
+                          Flags<memType> &flags) {
+            Memory<memType, memSize> memory{cells, registers};
+            size_t addr1 = memory.address(ins.arg1);
+            if (ins.type == FILL) {
+                size_t len = memory.length(addr1, ins.arg3);
+                std::fill_n(cells + addr1, len, memory.pvalue(ins.arg2));
+                return;
+            }
+            size_t addr2 = memory.address(ins.arg2);
+            size_t len = memory.length(addr1 > addr2 ? addr1 : addr2, ins.arg3);
+            if (ins.type == COPY)
+                std::memmove(cells + addr1, cells + addr2, len * sizeof(memType));
+            else
+                compare(cells + addr1, cells + addr2, len, flags);
+        }
+
+        // Executes In or Out, with the same checks as execute.
+        static void transfer(const Instruction &ins, memType *cells, memType *registers,
+                             Flags<memType> &flags, Ports<memType> &ports) {
+            Memory<memType, memSize> memory{cells, registers};
+            if (ins.type == OUT) {
+                ports.write(ports.port(memory.pvalue(ins.arg1)), memory.pvalue(ins.arg2));
+                return;
+            }
+            size_t port = ports.port(memory.pvalue(ins.arg2));
+            memType &lval = memory.lvalue(ins.arg1);
+            memType val = 0;
+            bool read = ports.read(port, val);
+            lval = val;
+            flags.update_zero(read);
+        }
+
+        // Executes Xadd, CmpXchg or Fence as sequentially consistent atomic operations, with
+        // the same checks as execute.
+        static void atomic(const Instruction &ins, memType *cells, memType *registers,
+                           Flags<memType> &flags) {
+            if (ins.type == FENCE) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return;
+            }
+            Memory<memType, memSize> memory{cells, registers};
+            memType &arg2 = memory.lvalue(ins.arg2);
+            if (ins.type == XADD) {
+                memType val = arg2;
+                memType &dst = memory.lvalue(ins.arg1);
+                memType old = __atomic_fetch_add(&dst, val, __ATOMIC_SEQ_CST);
+                flags.update_flags(static_cast<memType>(old + val));
+                if (&arg2 != &dst)
+                    arg2 = old;
+                return;
+            }
+            memType val = memory.pvalue(ins.arg3);
+            memType &dst = memory.lvalue(ins.arg1);
+            memType expected = arg2, old = expected;
+            bool written = __atomic_compare_exchange_n(&dst, &old, val, false, __ATOMIC_SEQ_CST,
+                                                       __ATOMIC_SEQ_CST);
+            flags.update_flags(expected - old);
+            if (!written)
+                arg2 = old;
+        }
+
+        // Gets handler of an instruction with operands of given kinds.
+        static Handler handler(OpType type, Kind kind1, Kind kind2) {
+#define TMPASM_HANDLER_MATCH(op, k1, k2) \
+            if (type == op && kind1 == k1 && kind2 == k2) \
+                return op##_##k1##_##k2;
+            TMPASM_HANDLERS(TMPASM_HANDLER_MATCH)
+#undef TMPASM_HANDLER_MATCH
+            switch (type) {
+                case JMP:
+                    return JUMP;
+                case JZ:
+                    return JUMP_Z;
+                default:
+                    return JUMP_S;
+            }
+        }
+
+        // Decodes operand kind. Returns false if its constant address or register is invalid.
+        static bool load_operand(const Operand &operand, Kind &kind, uint64_t &arg,
+                                 size_t &depth, bool &from_register, const char *&fault) {
+            depth = operand.depth;
+            if (depth == 0) {
+                kind = IMM;
+                arg = operand.value;
+                return true;
+            }
+            if (operand.kind == OpType::REG) {
+                kind = depth == 1 ? REG : IND;
+                from_register = true;
+                arg = operand.value;
+                if (arg < REGISTERS)
+                    return true;
+                fault = "Register out of register file";
+                return false;
+            }
+            kind = depth == 1 ? DIR : IND;
+            try {
+                arg = check_address<memType, memSize>(operand.value, operand.negative);
+            } catch (const char *message) {
+                // Error is reported only if the instruction gets executed.
+                fault = message;
+                return false;
+            }
+            return true;
+        }
+
+        template<typename Tracer>
+        static void traced_block(const Instruction &ins, memType *memory, memType *registers,
+                                 Flags<memType> &flags, Tracer &tracer, size_t index) {
+            if (ins.type == CMPRANGE) {
+                block(ins, memory, registers, flags);
+                tracer.record(index, flags);
+                return;
+            }
+            // Written range, found with the checks of block.
+            Memory<memType, memSize> cells{memory, registers};
+            size_t addr = cells.address(ins.arg1), len;
+            if (ins.type == FILL) {
+                len = cells.length(addr, ins.arg3);
+            } else {
+                size_t src = cells.address(ins.arg2);
+                len = cells.length(addr > src ? addr : src, ins.arg3);
+            }
+            std::vector<memType> before(memory + addr, memory + addr + len);
+            block(ins, memory, registers, flags);
+            record_writes(tracer, index, flags, memory, addr, before.data(), len);
+        }
+
+        template<typename Tracer>
+        static void traced_atomic(const Instruction &ins, memType *memory, memType *registers,
+                                  Flags<memType> &flags, Tracer &tracer, size_t index) {
+            if (ins.type == FENCE) {
+                atomic(ins, memory, registers, flags);
+                tracer.record(index, flags);
+                return;
+            }
+            // Written cells, found with the checks of atomic.
+            Memory<memType, memSize> cells{memory, registers};
+            memType &arg2 = cells.lvalue(ins.arg2);
+            if (ins.type == CMPXCHG)
+                cells.pvalue(ins.arg3);
+            memType &arg1 = cells.lvalue(ins.arg1);
+            const Operand *operands[] = {&ins.arg1, &ins.arg2};
+            memType *written[] = {&arg1, &arg2};
+            memType before[] = {arg1, arg2};
+            atomic(ins, memory, registers, flags);
+            bool first = true;
+            for (size_t i = 0; i < (&arg2 == &arg1 ? 1 : 2); ++i) {
+                if (*written[i] == before[i])
+                    continue;
+                size_t address = is_register(*operands[i]) ?
+                                 memSize + static_cast<size_t>(operands[i]->value) :
+                                 static_cast<size_t>(written[i] - memory);
+                tracer.record(index, flags, address, before[i], *written[i], first);
+                first = false;
+            }
+            if (first)
+                tracer.record(index, flags);
+        }
+
+        template<typename Tracer>
+        static void traced_transfer(const Instruction &ins, memType *memory, memType *registers,
+                                    Flags<memType> &flags, Ports<memType> &ports,
+                                    Tracer &tracer, size_t index) {
+            if (ins.type == OUT) {
+                transfer(ins, memory, registers, flags, ports);
+                tracer.record(index, flags);
+                return;
+            }
+            Memory<memType, memSize> cells{memory, registers};
+            size_t port = ports.port(cells.pvalue(ins.arg2));
+            memType &lval = cells.lvalue(ins.arg1);
+            memType old = lval, val = 0;
+            flags.update_zero(ports.read(port, val));
+            lval = val;
+            size_t address = is_register(ins.arg1) ?
+                             memSize + static_cast<size_t>(ins.arg1.value) :
+                             static_cast<size_t>(&lval - memory);
+            tracer.record(index, flags, address, old, lval, true);
+        }
+
+        // Runs ops from the first one. If labels is not null, only exports handler addresses.
+        template<typename Tracer>
+        TMPASM_NO_CROSSJUMPING
+        static void execute(const Op *code, memType *memory, memType *registers,
+                            Flags<memType> *flags_ptr, Calls *calls, const Instruction *blocks,
+                            Ports<memType> *ports, Tracer *tracer,
+                            const void *const **labels) {
+#if TMPASM_COMPUTED_GOTO
+#define TMPASM_HANDLER_LABEL(op, kind1, kind2) &&op##_##kind1##_##kind2,
+            static const void *const handler_labels[] = {
+                TMPASM_HANDLERS(TMPASM_HANDLER_LABEL)
+                &&JUMP, &&JUMP_Z, &&JUMP_S, &&SUBROUTINE, &&RETURN, &&BLOCK, &&PORT, &&ATOMIC,
+                &&HALT, &&FAULT
+            };
+#undef TMPASM_HANDLER_LABEL
+            if (labels) {
+                *labels = handler_labels;
+                return;
             }
-        } else if constexpr(Op::type == JS) {
-            if (env.SF) {
-                Op::template execute<memSize, memType, labels>(env);
+#else
+            if (labels)
+                return;
+#endif
+            Flags<memType> &flags = *flags_ptr;
+            const Op *ip = code;
+#if TMPASM_COMPUTED_GOTO
+            TMPASM_DISPATCH();
+#else
+            for (;;) {
+                switch (ip->handler) {
+#endif
+            TMPASM_HANDLERS(TMPASM_STEP_HANDLER)
+            TMPASM_CASE(JUMP)
+                if constexpr (Tracer::enabled)
+                    tracer->record(ip - code, flags);
+                ip = code + ip->target;
+                TMPASM_DISPATCH();
+            TMPASM_CASE(JUMP_Z)
+                if constexpr (Tracer::enabled)
+                    tracer->record(ip - code, flags);
+                ip = flags.ZF() ? code + ip->target : ip + 1;
+                TMPASM_DISPATCH();
+            TMPASM_CASE(JUMP_S)
+                if constexpr (Tracer::enabled)
+                    tracer->record(ip - code, flags);
+                ip = flags.SF() ? code + ip->target : ip + 1;
+                TMPASM_DISPATCH();
+            TMPASM_CASE(SUBROUTINE) {
+                // Cached results write the memoized cells.
+                std::array<memType, MEMO_CELLS> before{};
+                if constexpr (Tracer::enabled)
+                    std::copy_n(memory + ip->arg1, ip->arg2, before.data());
+                if (ip->arg2 != 0 && calls->memo.call(ip->target, ip->arg1, ip->arg2, memory,
+                                                      flags, calls->stack.size + 1)) {
+                    if constexpr (Tracer::enabled) {
+                        record_writes(*tracer, ip - code, flags, memory, ip->arg1,
+                                      before.data(), ip->arg2);
+                    }
+                    ++ip;
+                } else {
+                    if constexpr (Tracer::enabled)
+                        tracer->record(ip - code, flags);
+                    calls->stack.push(static_cast<size_t>(ip + 1 - code));
+                    ip = code + ip->target;
+                }
+                TMPASM_DISPATCH();
             }
-        } else if constexpr(Op::type != DECL && Op::type != LABEL) {
-            Op::template execute<memSize, memType>(env);
+            TMPASM_CASE(RETURN)
+                if constexpr (Tracer::enabled)
+                    tracer->record(ip - code, flags);
+                ip = code + calls->stack.pop();
+                calls->memo.ret(memory, flags, calls->stack.size + 1);
+                TMPASM_DISPATCH();
+            TMPASM_CASE(BLOCK)
+                if constexpr (Tracer::enabled)
+                    traced_block(blocks[ip->target], memory, registers, flags, *tracer,
+                                 ip - code);
+                else
+                    block(blocks[ip->target], memory, registers, flags);
+                ++ip;
+                TMPASM_DISPATCH();
+            TMPASM_CASE(PORT)
+                if constexpr (Tracer::enabled)
+                    traced_transfer(blocks[ip->target], memory, registers, flags, *ports,
+                                    *tracer, ip - code);
+                else
+                    transfer(blocks[ip->target], memory, registers, flags, *ports);
+                ++ip;
+                TMPASM_DISPATCH();
+            TMPASM_CASE(ATOMIC)
+                if constexpr (Tracer::enabled)
+                    traced_atomic(blocks[ip->target], memory, registers, flags, *tracer,
+                                  ip - code);
+                else
+                    atomic(blocks[ip->target], memory, registers, flags);
+                ++ip;
+                TMPASM_DISPATCH();
+            TMPASM_CASE(FAULT)
+                throw ip->fault;
+            TMPASM_CASE(HALT)
+                // Also the op after the last instruction.
+                if constexpr (Tracer::enabled)
+                    tracer->record(ip - code, flags);
+                return;
+#if !TMPASM_COMPUTED_GOTO
+                }
+            }
+#endif
+        }
+
+    public:
+        ThreadedCode(const Instruction *code, size_t size) {
+            // index[pc] = index of first op executed when jumping to pc.
+            std::vector<size_t> index(size + 1);
+            for (size_t pc = 0; pc < size; ++pc) {
+                index[pc] = ops.size();
+                OpType type = code[pc].type;
+                if (type == LABEL || type == DECL)
+                    continue;
+
+                Op op;
+                if (type == JMP || type == JZ || type == JS) {
+                    op.handler = handler(type, IMM, IMM);
+                    op.target = code[pc].target;
+                } else if (type == CALL || type == RET) {
+                    has_calls = true;
+                    op.handler = type == CALL ? SUBROUTINE : RETURN;
+                    op.target = code[pc].target;
+                    op.arg2 = code[pc].arg2.value;
+                    // Memoized cells are checked once, like constant addresses.
+                    if (op.arg2 != 0) {
+                        const Operand &first = code[pc].arg1;
+                        try {
+                            op.arg1 = check_address<memType, memSize>(first.value,
+                                                                      first.negative);
+                            check_address<memType, memSize>(op.arg1 + op.arg2 - 1, false);
+                        } catch (const char *message) {
+                            op.handler = FAULT;
+                            op.fault = message;
+                        }
+                    }
+                } else if (is_block(type) || is_port(type) || is_atomic(type)) {
+                    op.handler = is_block(type) ? BLOCK : is_port(type) ? PORT : ATOMIC;
+                    op.target = blocks.size();
+                    blocks.push_back(code[pc]);
+                    try {
+                        check_addresses<memType, memSize>(code + pc, 1);
+                    } catch (const char *message) {
+                        op.handler = FAULT;
+                        op.fault = message;
+                    }
+                } else if (type != HLT) {
+                    Kind kind1, kind2 = IMM;
+                    bool valid =
+                            load_operand(code[pc].arg1, kind1, op.arg1, op.depth1, op.indirect1,
+                                         op.fault) &&
+                            load_operand(code[pc].arg2, kind2, op.arg2, op.depth2, op.indirect2,
+                                         op.fault);
+                    op.handler = valid ? handler(type, kind1, kind2) : FAULT;
+                }
+                ops.push_back(op);
+                pcs.push_back(pc);
+            }
+            index[size] = ops.size();
+            ops.emplace_back();
+            pcs.push_back(size);
+
+            const void *const *labels = nullptr;
+            execute<NoTracer>(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                              nullptr, &labels);
+            for (Op &op : ops) {
+                if (op.handler == JUMP || op.handler == JUMP_Z || op.handler == JUMP_S ||
+                    op.handler == SUBROUTINE)
+                    op.target = index[op.target];
+                if (labels)
+                    op.label = labels[op.handler];
+            }
+        }
+
+        void execute(memType *memory, Flags<memType> &flags,
+                     Ports<memType> *ports = nullptr) const {
+            NoTracer tracer;
+            execute(memory, flags, tracer, ports);
+        }
+
+        // Registers are zeroed before every execution. Without ports, none is connected.
+        template<typename Tracer>
+        void execute(memType *memory, Flags<memType> &flags, Tracer &tracer,
+                     Ports<memType> *ports = nullptr) const {
+            std::array<memType, REGISTERS> registers{};
+            execute(memory, registers.data(), flags, tracer, ports);
         }
+
+        // Same as execute, with registers of the caller (e.g. a core of MulticoreComputer).
+        template<typename Tracer>
+        void execute(memType *memory, memType *registers, Flags<memType> &flags,
+                     Tracer &tracer, Ports<memType> *ports = nullptr) const {
+            std::unique_ptr<Calls> calls;
+            if (has_calls)
+                calls = std::make_unique<Calls>();
+            Ports<memType> own_ports;
+            execute(ops.data(), memory, registers, &flags, calls.get(), blocks.data(),
+                    ports ? ports : &own_ports, &tracer, nullptr);
+        }
+
+        // Index of the instruction of an op, the size of the program for the last op.
+        const std::vector<size_t> &instructions() const {
+            return pcs;
+        }
+    };
+
+#undef TMPASM_STEP_HANDLER
+#undef TMPASM_NO_CROSSJUMPING
+#undef TMPASM_DISPATCH
+#undef TMPASM_CASE
+#undef TMPASM_HANDLER_NAME
+#undef TMPASM_HANDLERS
+#undef TMPASM_BINARY_HANDLERS
+
+    //-----------------DIAGNOSTICS----------------------
+    template<char...>
+    constexpr bool never = false;
+
+    // Compilation errors of boot, naming the label by its characters.
+    template<char... label>
+    struct InfiniteLoopAtLabel {
+        static_assert(never<label...>, "Program repeats its state after a jump to the label");
+    };
+
+    template<char... label>
+    struct StepBudgetExceededAtLabel {
+        static_assert(never<label...>,
+                      "Program exceeds the step budget, the last taken jump was to the label");
+    };
+
+    template<template<char...> class Report, uint64_t label, size_t... i>
+    constexpr void report(std::index_sequence<i...>) {
+        static_cast<void>(sizeof(Report<id_name(label)[i]...>));
     }
-};
 
-// Empty program
-template<>
-struct Program<> {
-    template<size_t memSize, typename memType, typename labels>
-    static constexpr void run(Env<memType, memSize> &) {}
+    enum Stop { HALTED, OUT_OF_STEPS, REPEATED };
 
-    template<size_t memSize, typename memType, size_t var_count>
-    static constexpr void load_variables(Env<memType, memSize> &) {};
+    template<typename memType, size_t memSize>
+    struct Outcome {
+        std::array<memType, memSize> memory{};
+        Stop stop = HALTED;
+        // Label of the last taken jump, 0 if there was none.
+        uint64_t label = 0;
+    };
+
+    // Runs the program like boot, In reads port 0 from input. Without watch, states are
+    // watched only when steps run out, for at most steps more, to tell an infinite loop from
+    // a long computation. With an unlimited budget the program is optimized, otherwise steps
+    // are instructions of the program as written.
+    template<typename memType, size_t memSize, typename T, size_t steps, bool watch>
+    constexpr Outcome<memType, memSize> watched_boot(const memType *input, size_t count) {
+        Outcome<memType, memSize> ans;
+        Flags<memType> flags;
+        std::array<memType, REGISTERS> registers{};
+        CallStack calls;
+        CycleDetector<memType, memSize> cycles;
+        Ports<memType> ports;
+        ports.input(0, input, count);
+        const Memory<memType, memSize> memory{ans.memory.data(), registers.data()};
+
+        T::template check_program<memSize, memType>();
+
+        auto run = [&](const Instruction *code, size_t length) {
+            if constexpr (watch)
+                cycles.rehash(ans.memory.data(), registers.data());
+            size_t pc = execute<memType, memSize, false, watch>(
+                    memory, flags, code, length, {}, 0, steps, &calls, &cycles, &ports);
+            if (!watch && pc < length) {
+                cycles.rehash(ans.memory.data(), registers.data());
+                execute<memType, memSize, false, true>(memory, flags, code, length, {}, pc,
+                                                       steps, &calls, &cycles, &ports);
+            }
+            ans.stop = cycles.repeated ? REPEATED : pc < length ? OUT_OF_STEPS : HALTED;
+            ans.label = cycles.label;
+        };
+
+        // Loading variables.
+        T::template load_variables<memSize, memType, 0>(ans.memory.data());
+
+        if constexpr (steps == SIZE_MAX) {
+            // Optimizing the program, labels and declarations are not needed anymore.
+            // Counted loops are evaluated at once.
+            constexpr auto code = fold_loops<memType, memSize>(
+                    optimize<memType, memSize>(Bytecode<T>::decode()));
+            run(code.code.data(), code.length);
+        } else {
+            constexpr auto code = Bytecode<T>::decode();
+            run(code.data(), code.size());
+        }
+        return ans;
+    }
+} // anonymous namespace
 
-    static constexpr void check_program() {}
+// Result of Computer::profile: final memory and statistics of the execution.
+// Arrays are indexed by position of the instruction in the Program list.
+template<typename Type, size_t N, size_t size>
+struct Profile {
+    std::array<Type, N> memory{};
+    // Executed instructions, labels and declarations are not counted.
+    size_t steps = 0;
+    // Executions of every instruction, for labels times they were reached.
+    std::array<size_t, size> counts{};
+    // Outcomes of Jz and Js.
+    std::array<size_t, size> taken{}, not_taken{};
+    // Most often reached label, if there is none Id is 0 and index is size.
+    uint64_t hottest_label = 0;
+    size_t hottest_label_index = size;
 };
 
 template<size_t N, typename Type>
 struct Computer {
-    template<typename T>
+    static_assert(std::is_integral<Type>::value, "Computer requires integral types.");
+    static_assert(!std::is_same<Type, bool>::value, "Bool does not have unsigned version");
+
+    // Fails to compile with StepBudgetExceededAtLabel<label...> after steps instructions
+    // (labels and declarations are not counted), or with InfiniteLoopAtLabel<label...> when the
+    // state (memory, flags, pc and return addresses) repeats after a jump. States are watched
+    // when steps run out, or from the start with watch.
+    // Inputs have no values and outputs are not connected, they need boot with ports.
+    template<typename T, size_t steps = SIZE_MAX, bool watch = false>
     static constexpr std::array<Type, N> boot() {
-        static_assert(std::is_integral<Type>::value, "Computer requires integral types.");
-        static_assert(!std::is_same<Type, bool>::value, "Bool does not have unsigned version");
+        return boot<T, NO_INPUT, steps, watch>();
+    }
+
+    // Same as boot, In reads port 0 from input, e.g. a static constexpr std::array<Type, M>.
+    template<typename T, const auto &input, size_t steps = SIZE_MAX, bool watch = false>
+    static constexpr std::array<Type, N> boot() {
+        constexpr auto outcome = watched_boot<Type, N, T, steps, watch>(input.data(),
+                                                                        input.size());
+        constexpr auto label = std::make_index_sequence<id_length(outcome.label)>();
+        if constexpr (outcome.stop == REPEATED)
+            report<InfiniteLoopAtLabel, outcome.label>(label);
+        else if constexpr (outcome.stop == OUT_OF_STEPS)
+            report<StepBudgetExceededAtLabel, outcome.label>(label);
+        return outcome.memory;
+    }
+
+    // State before the first instruction of the program, with variables loaded.
+    template<typename T>
+    static constexpr Env<Type, N> initial() {
+        Env<Type, N> env;
+        T::template check_program<N, Type>();
+        T::template load_variables<N, Type, 0>(env.memory.data());
+        return env;
+    }
+
+    // Continues the program from env.pc for at most steps instructions, counted like in boot,
+    // so a long computation can be split between several constexpr evaluations. The program
+    // has finished when pc of the result is Bytecode<T>::size.
+    // Memory is not known in advance, so the program is not optimized.
+    template<typename T>
+    static constexpr Env<Type, N> boot(Env<Type, N> env, size_t steps = SIZE_MAX) {
+        Ports<Type> ports;
+        return boot<T>(env, ports, steps);
+    }
 
+    // Runs the program from label on given memory and flags, variables are not loaded.
+    template<typename T>
+    static constexpr Env<Type, N> boot(const std::array<Type, N> &memory, bool ZF, bool SF,
+                                       uint64_t label, size_t steps = SIZE_MAX) {
+        size_t pc = Bytecode<T>::label_address(label);
+        if (pc == Bytecode<T>::size)
+            throw "Label doesn't exist";
+        Env<Type, N> env{memory, {}, pc, {}};
+        env.flags.set(ZF, SF);
+        return boot<T>(env, steps);
+    }
+
+    // Same as boot(env, steps), with ports (connected to arrays during compilation).
+    template<typename T>
+    static constexpr Env<Type, N> boot(Env<Type, N> env, Ports<Type> &ports,
+                                       size_t steps = SIZE_MAX) {
+        T::template check_program<N, Type>();
+
+        constexpr auto code = Bytecode<T>::decode();
+        if (env.pc > code.size())
+            throw "Invalid program counter";
+        env.pc = execute<Type, N>(Memory<Type, N>{env.memory.data(), env.registers.data()},
+                                  env.flags, code.data(), code.size(), {}, env.pc, steps,
+                                  &env.calls, nullptr, &ports);
+        return env;
+    }
+
+    // Returns true if the program has finished in env.
+    template<typename T>
+    static constexpr bool finished(const Env<Type, N> &env) {
+        return env.pc >= Bytecode<T>::size;
+    }
+
+    // Same as boot, but also counts executions of every instruction.
+    template<typename T>
+    static constexpr auto profile() {
+        Profile<Type, N, Bytecode<T>::size> ans;
         Env<Type, N> env;
 
-        //check syntax
-        T::check_program();
+        T::template check_program<N, Type>();
+        constexpr auto code = Bytecode<T>::decode();
+        T::template load_variables<N, Type, 0>(env.memory.data());
+        execute<Type, N, true>(Memory<Type, N>{env.memory.data(), env.registers.data()},
+                               env.flags, code.data(), code.size(),
+                               {ans.counts.data(), ans.taken.data(), ans.not_taken.data()});
+
+        ans.memory = env.memory;
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (code[i].type == LABEL) {
+                if (ans.hottest_label_index == code.size() ||
+                    ans.counts[i] > ans.counts[ans.hottest_label_index]) {
+                    ans.hottest_label_index = i;
+                    ans.hottest_label = Bytecode<T>::labels[i];
+                }
+            } else if (code[i].type != DECL) {
+                ans.steps += ans.counts[i];
+            }
+        }
+        return ans;
+    }
+
+    // Executes the program at runtime, on memory owned by the caller.
+    // Results are the same as of boot, but steps are not limited by constexpr evaluation.
+    template<typename T>
+    static void run(std::array<Type, N> &memory) {
+        Ports<Type> ports;
+        run<T>(memory, ports);
+    }
+
+    // Same as run, with ports (e.g. from src/ports.h), whose outputs are flushed at the end.
+    template<typename T>
+    static void run(std::array<Type, N> &memory, Ports<Type> &ports) {
+        T::template check_program<N, Type>();
 
-        // Parsing labels.
-        using labels = typename LabelList<T>::result;
+        static constexpr auto code = optimize<Type, N>(Bytecode<T>::decode());
+        static const ThreadedCode<Type, N> threaded(code.code.data(), code.length);
 
-        // Loading variables.
-        T::template load_variables<N, Type, 0>(env);
+        memory.fill(0);
+        T::template load_variables<N, Type, 0>(memory.data());
 
-        // Executing the program.
-        T::template run<N, Type, labels>(env);
-        return env.memory;
+        Flags<Type> flags;
+        threaded.execute(memory.data(), flags, &ports);
+        ports.flush();
     }
+
+    // Executes decoded instructions (e.g. parsed from TMPAsm source) at runtime.
+    // Declarations are loaded to memory in their order, like in boot.
+    static void run(const std::vector<Instruction> &code, std::array<Type, N> &memory) {
+        Ports<Type> ports;
+        run(code, memory, ports);
+    }
+
+    static void run(const std::vector<Instruction> &code, std::array<Type, N> &memory,
+                    Ports<Type> &ports) {
+        ThreadedCode<Type, N> threaded(code.data(), code.size());
+
+        memory.fill(0);
+        load_declarations<Type, N>(code.data(), code.size(), memory.data());
+
+        Flags<Type> flags;
+        threaded.execute(memory.data(), flags, &ports);
+        ports.flush();
+    }
+
+private:
+    static constexpr std::array<Type, 0> NO_INPUT{};
 };
 
 #endif // COMPUTER_H
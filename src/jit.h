@@ -0,0 +1,365 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "computer.h"
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "TMPAsm JIT requires Linux on x86-64"
+#endif
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <new>
+#include <sys/mman.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace {
+//-----------------X86-64 ENCODING----------------
+    // Registers used by compiled code:
+    // rdi - memory, rsi - flags, r8b - ZF, r9b - SF, r11 - memory size,
+    // rdx and rcx - addresses and values of operands, eax - result.
+    enum Register : uint8_t {
+        RAX = 0, RCX = 1, RDX = 2
+    };
+
+    // Emits machine code operating on memory cells of memType.
+    template<typename memType>
+    class Assembler {
+        static constexpr size_t width = sizeof(memType);
+        static constexpr uint8_t scale = width == 1 ? 0 : width == 2 ? 1 : width == 4 ? 2 : 3;
+
+    public:
+        std::vector<uint8_t> code;
+
+        void bytes(std::initializer_list<uint8_t> list) {
+            code.insert(code.end(), list);
+        }
+
+        void imm32(uint32_t val) {
+            for (int i = 0; i < 4; ++i)
+                code.push_back(static_cast<uint8_t>(val >> (8 * i)));
+        }
+
+        void imm64(uint64_t val) {
+            for (int i = 0; i < 8; ++i)
+                code.push_back(static_cast<uint8_t>(val >> (8 * i)));
+        }
+
+        // Operand size prefix of memType instructions.
+        void prefix() {
+            if (width == 2)
+                code.push_back(0x66);
+            else if (width == 8)
+                code.push_back(0x48);
+        }
+
+        // ModRM and SIB of [rdi + index * width] with reg field.
+        void memory(uint8_t reg, Register index) {
+            code.push_back(static_cast<uint8_t>(reg << 3 | 4));
+            code.push_back(static_cast<uint8_t>(scale << 6 | index << 3 | 7));
+        }
+
+        // op [rdi + index * width], reg or op [rdi + index * width] with opcode extension.
+        void memory_op(uint8_t opcode8, uint8_t opcode, uint8_t reg, Register index) {
+            prefix();
+            code.push_back(width == 1 ? opcode8 : opcode);
+            memory(reg, index);
+        }
+
+        // reg = [rdi + index * width], extended to 64 bits according to memType sign.
+        void load(Register reg, Register index) {
+            constexpr bool sign = std::is_signed<memType>::value;
+            if (width == 1 || width == 2) {
+                if (sign)
+                    code.push_back(0x48);
+                bytes({0x0F, static_cast<uint8_t>((sign ? 0xBE : 0xB6) + (width == 2))});
+            } else if (width == 4) {
+                if (sign)
+                    bytes({0x48, 0x63});
+                else
+                    code.push_back(0x8B);
+            } else {
+                bytes({0x48, 0x8B});
+            }
+            memory(reg, index);
+        }
+
+        // reg = val
+        void mov_imm(Register reg, uint64_t val) {
+            if (val <= UINT32_MAX) {
+                code.push_back(static_cast<uint8_t>(0xB8 + reg));
+                imm32(static_cast<uint32_t>(val));
+            } else {
+                bytes({0x48, static_cast<uint8_t>(0xB8 + reg)});
+                imm64(val);
+            }
+        }
+
+        // Emits conditional (0x0F, cc) or unconditional (0xE9) jump, returns its position.
+        size_t jump(std::initializer_list<uint8_t> opcode) {
+            bytes(opcode);
+            imm32(0);
+            return code.size();
+        }
+
+        // Sets jump ending at position to go to target.
+        void patch(size_t position, size_t target) {
+            auto rel = static_cast<uint32_t>(static_cast<int64_t>(target) -
+                                             static_cast<int64_t>(position));
+            std::memcpy(&code[position - 4], &rel, 4);
+        }
+    };
+
+    // Program compiled to native x86-64 code in executable pages.
+    template<typename memType, size_t memSize>
+    class JitCode {
+        // Flags computed by compiled code, kept in r8b and r9b while it runs.
+        struct FlagBytes {
+            bool ZF, SF;
+        };
+
+        using Function = uint32_t (*)(memType *, FlagBytes *);
+
+        static constexpr uint8_t ZF_OFFSET = offsetof(FlagBytes, ZF);
+        static constexpr uint8_t SF_OFFSET = offsetof(FlagBytes, SF);
+
+        Assembler<memType> as;
+        // Compiled code returns 0 or 1 + index of the error message.
+        std::vector<const char *> faults{"Invalid address", "Address out of Computer's memory"};
+        // Jumps to the common error exits.
+        std::vector<size_t> invalid_jumps, out_of_memory_jumps;
+        void *pages = nullptr;
+        size_t pages_size = 0;
+
+        // Emits return with the error.
+        void fault(const char *message) {
+            faults.push_back(message);
+            as.mov_imm(RAX, faults.size());
+            as.code.push_back(0xC3);
+        }
+
+        // Emits reg = address of Mem operand, following Mem<Mem<...>> with checks.
+        // Returns false if its constant address is invalid.
+        bool address(const Operand &op, Register reg) {
+            size_t addr;
+            try {
+                addr = check_address<memType, memSize>(op.value, op.negative);
+            } catch (const char *message) {
+                // Error is reported only if the instruction gets executed.
+                fault(message);
+                return false;
+            }
+            as.mov_imm(reg, addr);
+            for (size_t i = 1; i < op.depth; ++i) {
+                as.load(reg, reg);
+                if (std::is_signed<memType>::value) {
+                    // test reg, reg; js invalid
+                    as.bytes({0x48, 0x85, static_cast<uint8_t>(0xC0 | reg << 3 | reg)});
+                    invalid_jumps.push_back(as.jump({0x0F, 0x88}));
+                }
+                // cmp reg, r11; jae out_of_memory
+                as.bytes({0x4C, 0x39, static_cast<uint8_t>(0xD8 | reg)});
+                out_of_memory_jumps.push_back(as.jump({0x0F, 0x83}));
+            }
+            return true;
+        }
+
+        // Emits reg = value of pvalue operand.
+        bool value(const Operand &op, Register reg) {
+            if (op.depth == 0) {
+                as.mov_imm(reg, static_cast<uint64_t>(static_cast<memType>(op.value)) &
+                                std::numeric_limits<typename std::make_unsigned<memType>::type>::max());
+                return true;
+            }
+            if (!address(op, reg))
+                return false;
+            as.load(reg, reg);
+            return true;
+        }
+
+        // Emits ZF (and SF for arithmetic) update from flags of the last x86 instruction.
+        void update_flags(bool arithmetic) {
+            // setz r8b
+            as.bytes({0x41, 0x0F, 0x94, 0xC0});
+            if (!arithmetic)
+                return;
+            if (std::is_signed<memType>::value) {
+                // sets r9b
+                as.bytes({0x41, 0x0F, 0x98, 0xC1});
+            } else {
+                // xor r9d, r9d
+                as.bytes({0x45, 0x31, 0xC9});
+            }
+        }
+
+        void compile(const Instruction &ins) {
+            switch (ins.type) {
+                case MOV:
+                    if (address(ins.arg1, RDX) && value(ins.arg2, RCX))
+                        as.memory_op(0x88, 0x89, RCX, RDX);
+                    break;
+                case ADD:
+                case SUB:
+                case AND:
+                case OR: {
+                    if (!address(ins.arg1, RDX) || !value(ins.arg2, RCX))
+                        break;
+                    // op [rdi + rdx * width], rcx
+                    uint8_t opcode = ins.type == ADD ? 0x00 : ins.type == SUB ? 0x28 :
+                                     ins.type == AND ? 0x20 : 0x08;
+                    as.memory_op(opcode, opcode + 1, RCX, RDX);
+                    update_flags(ins.type == ADD || ins.type == SUB);
+                    break;
+                }
+                case CMP:
+                    if (!value(ins.arg1, RDX) || !value(ins.arg2, RCX))
+                        break;
+                    // cmp rdx, rcx
+                    as.prefix();
+                    as.bytes({static_cast<uint8_t>(sizeof(memType) == 1 ? 0x38 : 0x39), 0xCA});
+                    update_flags(true);
+                    break;
+                case INC:
+                case DEC:
+                    if (!address(ins.arg1, RDX))
+                        break;
+                    as.memory_op(0xFE, 0xFF, ins.type == INC ? 0 : 1, RDX);
+                    update_flags(true);
+                    break;
+                case NOT:
+                    if (!address(ins.arg1, RDX))
+                        break;
+                    // xor [rdi + rdx * width], -1 sets ZF unlike not.
+                    as.memory_op(0x80, 0x83, 6, RDX);
+                    as.code.push_back(0xFF);
+                    update_flags(false);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+    public:
+        JitCode(const Instruction *code, size_t size) {
+            // Prologue: load flags and memory size.
+            as.bytes({0x44, 0x0F, 0xB6, 0x46, ZF_OFFSET});
+            as.bytes({0x44, 0x0F, 0xB6, 0x4E, SF_OFFSET});
+            as.bytes({0x49, 0xBB});
+            as.imm64(memSize);
+
+            // start[pc] = position of native code of instruction pc.
+            std::vector<size_t> start(size + 1);
+            std::vector<std::pair<size_t, size_t>> jumps;
+            for (size_t pc = 0; pc < size; ++pc) {
+                start[pc] = as.code.size();
+                const Instruction &ins = code[pc];
+                if (ins.type == CALL || ins.type == RET) {
+                    throw "Calls are not compiled";
+                } else if (is_block(ins.type)) {
+                    throw "Block instructions are not compiled";
+                } else if (has_registers(&ins, 1)) {
+                    throw "Registers are not compiled";
+                } else if (is_port(ins.type)) {
+                    throw "Ports are not compiled";
+                } else if (is_atomic(ins.type)) {
+                    throw "Atomic instructions are not compiled";
+                } else if (ins.type == JMP) {
+                    jumps.emplace_back(as.jump({0xE9}), ins.target);
+                } else if (ins.type == HLT) {
+                    jumps.emplace_back(as.jump({0xE9}), size);
+                } else if (ins.type == JZ || ins.type == JS) {
+                    // test r8b, r8b or test r9b, r9b; jnz target
+                    as.bytes({0x45, 0x84, static_cast<uint8_t>(ins.type == JZ ? 0xC0 : 0xC9)});
+                    jumps.emplace_back(as.jump({0x0F, 0x85}), ins.target);
+                } else {
+                    compile(ins);
+                }
+            }
+            start[size] = as.code.size();
+            for (auto [position, target] : jumps)
+                as.patch(position, start[target]);
+
+            // Epilogue: store flags and return 0.
+            as.bytes({0x44, 0x88, 0x46, ZF_OFFSET});
+            as.bytes({0x44, 0x88, 0x4E, SF_OFFSET});
+            as.bytes({0x31, 0xC0, 0xC3});
+
+            size_t invalid = as.code.size();
+            as.mov_imm(RAX, 1);
+            as.code.push_back(0xC3);
+            size_t out_of_memory = as.code.size();
+            as.mov_imm(RAX, 2);
+            as.code.push_back(0xC3);
+            for (size_t position : invalid_jumps)
+                as.patch(position, invalid);
+            for (size_t position : out_of_memory_jumps)
+                as.patch(position, out_of_memory);
+
+            pages_size = as.code.size();
+            pages = mmap(nullptr, pages_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (pages == MAP_FAILED)
+                throw std::bad_alloc();
+            std::memcpy(pages, as.code.data(), pages_size);
+            if (mprotect(pages, pages_size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(pages, pages_size);
+                throw std::bad_alloc();
+            }
+        }
+
+        JitCode(const JitCode &) = delete;
+        JitCode &operator=(const JitCode &) = delete;
+
+        ~JitCode() {
+            munmap(pages, pages_size);
+        }
+
+        void execute(memType *memory, Flags<memType> &flags) const {
+            FlagBytes bytes{flags.ZF(), flags.SF()};
+            uint32_t result = reinterpret_cast<Function>(pages)(memory, &bytes);
+            if (result != 0)
+                throw faults[result - 1];
+            flags.set(bytes.ZF, bytes.SF);
+        }
+    };
+} // anonymous namespace
+
+// Computer running programs compiled to native code, results are the same as of boot.
+template<size_t N, typename Type>
+struct JitComputer {
+    static_assert(std::is_integral<Type>::value, "Computer requires integral types.");
+    static_assert(!std::is_same<Type, bool>::value, "Bool does not have unsigned version");
+
+    // Programs with subroutines, block instructions, registers, ports or atomic instructions
+    // are run by the threaded interpreter, which uses memset, memmove and vector compares for
+    // blocks. No port is connected.
+    template<typename T>
+    static void run(std::array<Type, N> &memory) {
+        T::template check_program<N, Type>();
+
+        static constexpr auto code = optimize<Type, N>(Bytecode<T>::decode());
+        if constexpr (has_calls(code.code.data(), code.length) ||
+                      has_blocks(code.code.data(), code.length) ||
+                      has_registers(code.code.data(), code.length) ||
+                      has_ports(code.code.data(), code.length) ||
+                      has_atomics(code.code.data(), code.length)) {
+            Computer<N, Type>::template run<T>(memory);
+        } else {
+            static const JitCode<Type, N> jit(code.code.data(), code.length);
+
+            memory.fill(0);
+            T::template load_variables<N, Type, 0>(memory.data());
+
+            Flags<Type> flags;
+            jit.execute(memory.data(), flags);
+        }
+    }
+};
+
+#endif // JIT_H
@@ -0,0 +1,106 @@
+#include "lockstep.h"
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+constexpr size_t N = 8;
+constexpr size_t LANES = 64;
+
+// Lanes diverge on the sign of cell 2 and on the trip count of the loop.
+using tmpasm_diverge = Program<
+        D<Id("n"), Num<0>>,
+        D<Id("s"), Num<0>>,
+        And<Mem<Num<3>>, Num<15>>,
+        Label<Id("loop")>,
+        Cmp<Mem<Lea<Id("n")>>, Mem<Num<3>>>,
+        Jz<Id("done")>,
+        Add<Mem<Lea<Id("s")>>, Mem<Num<4>>>,
+        Inc<Mem<Lea<Id("n")>>>,
+        Jmp<Id("loop")>,
+        Label<Id("done")>,
+        Cmp<Mem<Num<2>>, Num<0>>,
+        Js<Id("neg")>,
+        Not<Mem<Num<5>>>,
+        Jmp<Id("end")>,
+        Label<Id("neg")>,
+        Or<Mem<Num<6>>, Mem<Lea<Id("s")>>>,
+        Label<Id("end")>>;
+
+// Lanes with cell 7 out of memory fail, the others write through it.
+using tmpasm_store = Program<
+        Sub<Mem<Num<6>>, Mem<Num<7>>>,
+        Mov<Mem<Mem<Num<7>>>, Num<9>>,
+        Inc<Mem<Num<5>>>>;
+
+template<typename Type>
+struct Expected {
+    std::array<Type, N> memory{};
+    const char *error = nullptr;
+};
+
+// Runs P at runtime like Computer::run, but on given memory.
+template<typename Type, typename P>
+Expected<Type> reference(const std::array<Type, N> &memory) {
+    Expected<Type> ans;
+    Env<Type, N> env;
+    env.memory = memory;
+    P::template load_variables<N, Type, 0>(env.memory.data());
+    try {
+        env = Computer<N, Type>::template boot<P>(env);
+    } catch (const char *message) {
+        ans.error = message;
+    }
+    ans.memory = env.memory;
+    return ans;
+}
+
+// Lanes of the first group have zeroed memory and are compared with Computer::run.
+template<typename Type, typename P>
+bool lockstep(const char *name) {
+    using Lockstep = LockstepComputer<N, Type, LANES>;
+    std::vector<typename Lockstep::Lanes> groups(3);
+    std::vector<std::array<Type, N>> memories(groups.size() * LANES);
+    for (size_t i = LANES; i < memories.size(); ++i) {
+        for (size_t addr = 0; addr < N; ++addr) {
+            memories[i][addr] = static_cast<Type>(i * 13 + addr * 5 - 70);
+            groups[i / LANES].cell(addr, i % LANES) = memories[i][addr];
+        }
+    }
+    for (auto &group : groups)
+        Lockstep::template run<P>(group);
+
+    Expected<Type> zeroed;
+    try {
+        Computer<N, Type>::template run<P>(zeroed.memory);
+    } catch (const char *message) {
+        zeroed.error = message;
+    }
+    for (size_t i = 0; i < memories.size(); ++i) {
+        Expected<Type> expected = i < LANES ? zeroed : reference<Type, P>(memories[i]);
+        auto &group = groups[i / LANES];
+        const char *error = group.errors[i % LANES];
+        bool same = error && expected.error ? std::strcmp(error, expected.error) == 0 :
+                    !error && !expected.error;
+        for (size_t addr = 0; addr < N && same && !error; ++addr)
+            same = group.cell(addr, i % LANES) == expected.memory[addr];
+        if (!same) {
+            std::cerr << "Failed [" << name << " lane " << i << "]." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Words of 32 and 64 bits run lane by lane unless the build has wide vectors.
+template<typename Type>
+bool lockstep() {
+    return lockstep<Type, tmpasm_diverge>("tmpasm_diverge") &
+           lockstep<Type, tmpasm_store>("tmpasm_store");
+}
+
+int main() {
+    bool ok = lockstep<int8_t>() & lockstep<uint8_t>() & lockstep<int16_t>() &
+              lockstep<uint32_t>() & lockstep<int64_t>();
+    return ok ? 0 : 1;
+}
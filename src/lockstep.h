@@ -0,0 +1,433 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "computer.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace {
+//-----------------LOCKSTEP EXECUTION-------------
+    // Program run by lanes instances at once. Memory is a structure of arrays: cell addr of
+    // lane l is memory[addr * lanes + l], so a constant address is a row of lanes cells.
+    // Lanes at the same instruction execute it together, with loops over lanes that the
+    // compiler vectorizes (AVX2 or AVX-512 with -O3 -march=native). After a divergent jump
+    // lanes are split by masks, like in SIMT, and join again when they meet.
+    template<typename memType, size_t memSize, size_t lanes>
+    class LockstepCode {
+        enum Kind {
+            IMM, DIR, IND
+        };
+
+        struct Op {
+            OpType type = LABEL;
+            Kind kind1 = IMM, kind2 = IMM;
+            // Value of IMM, otherwise address of first memory access.
+            uint64_t arg1 = 0, arg2 = 0;
+            size_t depth1 = 0, depth2 = 0;
+            size_t target = 0;
+            // Error of an invalid constant address, reported if the op gets executed.
+            const char *fault = nullptr;
+        };
+
+        // Value of every lane, masks and flags are all ones for true and zero for false.
+        using Row = std::array<memType, lanes>;
+        using Addresses = std::array<size_t, lanes>;
+
+        static constexpr memType ALL = static_cast<memType>(~memType(0));
+
+        struct State {
+            memType *memory;
+            const char **errors;
+            // Lanes executing the current instruction.
+            Row mask{};
+            Row zf{}, sf{};
+        };
+
+        // Lanes waiting at another instruction after divergent jumps.
+        struct Group {
+            size_t pc;
+            Row mask;
+        };
+
+        std::vector<Op> ops;
+        std::vector<memType> variables;
+
+        static void fail(State &state, size_t lane, const char *message) {
+            state.errors[lane] = message;
+            state.mask[lane] = 0;
+        }
+
+        static bool any(const Row &mask) {
+            memType ans = 0;
+            for (size_t l = 0; l < lanes; ++l)
+                ans |= mask[l];
+            return ans != 0;
+        }
+
+        // Follows Mem<Mem<...>> chains of lanes in mask, lanes with invalid addresses fail.
+        static void indirect(State &state, uint64_t addr, size_t depth, Addresses &addrs) {
+            for (size_t l = 0; l < lanes; ++l) {
+                if (!state.mask[l])
+                    continue;
+                size_t a = addr;
+                try {
+                    for (size_t i = 1; i < depth; ++i) {
+                        memType val = state.memory[a * lanes + l];
+                        a = check_address<memType, memSize>(val, is_negative(val));
+                    }
+                } catch (const char *message) {
+                    fail(state, l, message);
+                    continue;
+                }
+                addrs[l] = a;
+            }
+        }
+
+        // Gets pvalue of all lanes, a memory row or values gathered to buffer.
+        static const memType *pvalues(State &state, Kind kind, uint64_t arg, size_t depth,
+                                      Row &buffer, Addresses &addrs) {
+            if (kind == IMM) {
+                buffer.fill(static_cast<memType>(arg));
+                return buffer.data();
+            }
+            if (kind == DIR)
+                return state.memory + arg * lanes;
+            indirect(state, arg, depth, addrs);
+            for (size_t l = 0; l < lanes; ++l)
+                buffer[l] = state.mask[l] ? state.memory[addrs[l] * lanes + l] : 0;
+            return buffer.data();
+        }
+
+        // Computes the instruction for every lane and keeps results of lanes in mask only.
+        // Operands are copied first, so the loop does not alias memory and has no branches
+        // on lane values, which lets the compiler turn it into vector operations.
+        template<OpType type>
+        static void apply(const memType *arg1, const memType *arg2, memType *result,
+                          State &state) {
+            Row a, b, out;
+            std::copy(arg1, arg1 + lanes, a.begin());
+            if (arg2)
+                std::copy(arg2, arg2 + lanes, b.begin());
+            for (size_t l = 0; l < lanes; ++l) {
+                memType m = state.mask[l], val;
+                if constexpr (type == MOV)
+                    val = b[l];
+                else if constexpr (type == ADD)
+                    val = static_cast<memType>(a[l] + b[l]);
+                else if constexpr (type == SUB || type == CMP)
+                    val = static_cast<memType>(a[l] - b[l]);
+                else if constexpr (type == AND)
+                    val = static_cast<memType>(a[l] & b[l]);
+                else if constexpr (type == OR)
+                    val = static_cast<memType>(a[l] | b[l]);
+                else if constexpr (type == INC)
+                    val = static_cast<memType>(a[l] + 1);
+                else if constexpr (type == DEC)
+                    val = static_cast<memType>(a[l] - 1);
+                else
+                    val = static_cast<memType>(~a[l]);
+
+                out[l] = static_cast<memType>((val & m) | (a[l] & ~m));
+                if constexpr (type != MOV) {
+                    memType z = val == 0 ? ALL : 0;
+                    state.zf[l] = static_cast<memType>((z & m) | (state.zf[l] & ~m));
+                }
+                if constexpr (type != MOV && type != AND && type != OR && type != NOT) {
+                    memType s = is_negative(val) ? ALL : 0;
+                    state.sf[l] = static_cast<memType>((s & m) | (state.sf[l] & ~m));
+                }
+            }
+            if constexpr (type != CMP)
+                std::copy(out.begin(), out.end(), result);
+        }
+
+        // Executes a non-jump instruction for lanes in mask, failed lanes leave the mask.
+        static void step(const Op &op, State &state) {
+            if (op.fault) {
+                for (size_t l = 0; l < lanes; ++l) {
+                    if (state.mask[l])
+                        fail(state, l, op.fault);
+                }
+                return;
+            }
+
+            Row buffer1, buffer2;
+            Addresses addrs1, addrs2;
+            const memType *arg2 = op.type == INC || op.type == DEC || op.type == NOT ? nullptr :
+                                  pvalues(state, op.kind2, op.arg2, op.depth2, buffer2, addrs2);
+            const memType *arg1 = pvalues(state, op.kind1, op.arg1, op.depth1, buffer1, addrs1);
+            // Lvalue row is updated in place, gathered lvalues are written back.
+            memType *result = op.kind1 == DIR ? state.memory + op.arg1 * lanes : buffer1.data();
+            switch (op.type) {
+                case MOV:
+                    apply<MOV>(arg1, arg2, result, state);
+                    break;
+                case ADD:
+                    apply<ADD>(arg1, arg2, result, state);
+                    break;
+                case SUB:
+                    apply<SUB>(arg1, arg2, result, state);
+                    break;
+                case AND:
+                    apply<AND>(arg1, arg2, result, state);
+                    break;
+                case OR:
+                    apply<OR>(arg1, arg2, result, state);
+                    break;
+                case CMP:
+                    apply<CMP>(arg1, arg2, result, state);
+                    return;
+                case INC:
+                    apply<INC>(arg1, arg2, result, state);
+                    break;
+                case DEC:
+                    apply<DEC>(arg1, arg2, result, state);
+                    break;
+                default:
+                    apply<NOT>(arg1, arg2, result, state);
+                    break;
+            }
+            if (op.kind1 == IND) {
+                for (size_t l = 0; l < lanes; ++l) {
+                    if (state.mask[l])
+                        state.memory[addrs1[l] * lanes + l] = buffer1[l];
+                }
+            }
+        }
+
+        // Decodes operand kind, like ThreadedCode. Returns false if its constant address is
+        // invalid.
+        static bool load_operand(const Operand &operand, Kind &kind, uint64_t &arg,
+                                 size_t &depth, const char *&fault) {
+            depth = operand.depth;
+            if (depth == 0) {
+                kind = IMM;
+                arg = operand.value;
+                return true;
+            }
+            kind = depth == 1 ? DIR : IND;
+            try {
+                arg = check_address<memType, memSize>(operand.value, operand.negative);
+            } catch (const char *message) {
+                fault = message;
+                return false;
+            }
+            return true;
+        }
+
+    public:
+        LockstepCode(const Instruction *code, size_t size) {
+            // index[pc] = index of first op executed when jumping to pc.
+            std::vector<size_t> index(size + 1);
+            for (size_t pc = 0; pc < size; ++pc) {
+                index[pc] = ops.size();
+                const Instruction &ins = code[pc];
+                if (ins.type == DECL) {
+                    if (variables.size() == memSize)
+                        throw "Not enough memory for variables";
+                    variables.push_back(static_cast<memType>(ins.arg2.value));
+                }
+                if (ins.type == LABEL || ins.type == DECL)
+                    continue;
+                // Lanes would need own return addresses.
+                if (ins.type == CALL || ins.type == RET)
+                    throw "Calls are not supported in lockstep";
+                // Blocks of lanes would start at different addresses.
+                if (is_block(ins.type))
+                    throw "Block instructions are not supported in lockstep";
+                if (has_registers(&ins, 1))
+                    throw "Registers are not supported in lockstep";
+                // Lanes would read the same inputs.
+                if (is_port(ins.type))
+                    throw "Ports are not supported in lockstep";
+                // Lanes do not share memory.
+                if (is_atomic(ins.type))
+                    throw "Atomic instructions are not supported in lockstep";
+
+                Op op;
+                op.type = ins.type;
+                op.target = ins.target;
+                // Halting is a jump to the end.
+                if (ins.type == HLT) {
+                    op.type = JMP;
+                    op.target = size;
+                }
+                if (op.type != JMP && ins.type != JZ && ins.type != JS &&
+                    load_operand(ins.arg1, op.kind1, op.arg1, op.depth1, op.fault))
+                    load_operand(ins.arg2, op.kind2, op.arg2, op.depth2, op.fault);
+                ops.push_back(op);
+            }
+            index[size] = ops.size();
+            for (Op &op : ops) {
+                if (op.type == JMP || op.type == JZ || op.type == JS)
+                    op.target = index[op.target];
+            }
+        }
+
+        // Loads variables to every lane and runs the program. Lanes with errors stop,
+        // the others run to the end.
+        void execute(memType *memory, const char **errors) const {
+            for (size_t i = 0; i < variables.size(); ++i)
+                std::fill(memory + i * lanes, memory + (i + 1) * lanes, variables[i]);
+
+            const size_t size = ops.size();
+            State state{memory, errors};
+            std::fill(errors, errors + lanes, nullptr);
+            state.mask.fill(ALL);
+            std::vector<Group> waiting;
+            size_t pc = 0;
+            for (;;) {
+                if (pc >= size || !any(state.mask)) {
+                    // Current lanes are done, the lowest waiting group continues.
+                    if (waiting.empty())
+                        return;
+                    pc = waiting.back().pc;
+                    state.mask = waiting.back().mask;
+                    waiting.pop_back();
+                    continue;
+                }
+
+                const Op &op = ops[pc];
+                size_t next = pc + 1;
+                if (op.type == JMP) {
+                    next = op.target;
+                } else if (op.type == JZ || op.type == JS) {
+                    const Row &flag = op.type == JZ ? state.zf : state.sf;
+                    Row taken;
+                    for (size_t l = 0; l < lanes; ++l) {
+                        taken[l] = static_cast<memType>(state.mask[l] & flag[l]);
+                        state.mask[l] = static_cast<memType>(state.mask[l] & ~flag[l]);
+                    }
+                    if (!any(state.mask)) {
+                        state.mask = taken;
+                        next = op.target;
+                    } else if (any(taken)) {
+                        // Lanes diverge, taken ones wait at the target.
+                        wait(waiting, op.target, taken);
+                    }
+                } else {
+                    step(op, state);
+                }
+                pc = next;
+
+                // Lanes meeting at pc run together again. The lowest pc runs first,
+                // so lanes behind catch up with the others.
+                if (!waiting.empty() && waiting.back().pc <= pc) {
+                    if (waiting.back().pc == pc) {
+                        for (size_t l = 0; l < lanes; ++l)
+                            state.mask[l] |= waiting.back().mask[l];
+                        waiting.pop_back();
+                    } else {
+                        Group current{pc, state.mask};
+                        pc = waiting.back().pc;
+                        state.mask = waiting.back().mask;
+                        waiting.pop_back();
+                        wait(waiting, current.pc, current.mask);
+                    }
+                }
+            }
+        }
+
+        // Adds lanes to the group waiting at pc. Groups are sorted by descending pc.
+        static void wait(std::vector<Group> &waiting, size_t pc, const Row &mask) {
+            auto it = waiting.begin();
+            while (it != waiting.end() && it->pc > pc)
+                ++it;
+            if (it != waiting.end() && it->pc == pc) {
+                for (size_t l = 0; l < lanes; ++l)
+                    it->mask[l] |= mask[l];
+            } else {
+                waiting.insert(it, {pc, mask});
+            }
+        }
+    };
+} // anonymous namespace
+
+// Bytes of the widest vectors the compiler can use for loops over lanes.
+#if defined(__AVX512F__)
+#define TMPASM_VECTOR_BYTES 64
+#elif defined(__AVX2__)
+#define TMPASM_VECTOR_BYTES 32
+#else
+#define TMPASM_VECTOR_BYTES 16
+#endif
+
+// Computer running one program on K memories at once, in lockstep.
+template<size_t N, typename Type, size_t K>
+struct LockstepComputer {
+    static_assert(std::is_integral<Type>::value, "Computer requires integral types.");
+    static_assert(!std::is_same<Type, bool>::value, "Bool does not have unsigned version");
+    static_assert(K > 0, "Lockstep requires at least one lane.");
+
+    // Lanes run in lockstep when a vector holds at least 8 words. With fewer, e.g. 64-bit words
+    // without AVX2, running lanes one by one on the threaded interpreter is faster.
+    static constexpr bool vectorized = TMPASM_VECTOR_BYTES / sizeof(Type) >= 8;
+
+    // Memories of K instances, structure of arrays.
+    struct Lanes {
+        // Memory before loading variables, instead of zeros. Variables are loaded to all lanes.
+        std::vector<Type> memory = std::vector<Type>(N * K);
+        // Error of every lane, nullptr if there was none.
+        std::array<const char *, K> errors{};
+
+        Type &cell(size_t addr, size_t lane) {
+            return memory[addr * K + lane];
+        }
+    };
+
+    // Results of every lane are the same as of Computer::run on its memory.
+    template<typename T>
+    static void run(Lanes &lanes) {
+        T::template check_program<N, Type>();
+
+        static constexpr auto code = Bytecode<T>::decode();
+        // Programs are checked by LockstepCode also when lanes run one by one.
+        static const LockstepCode<Type, N, K> lockstep(code.data(), code.size());
+        if constexpr (vectorized) {
+            lockstep.execute(lanes.memory.data(), lanes.errors.data());
+        } else {
+            static const ThreadedCode<Type, N> threaded(code.data(), code.size());
+            run_lanes(threaded, code.data(), code.size(), lanes);
+        }
+    }
+
+    static void run(const std::vector<Instruction> &code, Lanes &lanes) {
+        LockstepCode<Type, N, K> lockstep(code.data(), code.size());
+        if constexpr (vectorized) {
+            lockstep.execute(lanes.memory.data(), lanes.errors.data());
+        } else {
+            ThreadedCode<Type, N> threaded(code.data(), code.size());
+            run_lanes(threaded, code.data(), code.size(), lanes);
+        }
+    }
+
+private:
+    // Runs lanes one by one, like BatchComputer runs jobs.
+    static void run_lanes(const ThreadedCode<Type, N> &threaded, const Instruction *code,
+                          size_t size, Lanes &lanes) {
+        std::array<Type, N> memory;
+        for (size_t lane = 0; lane < K; ++lane) {
+            for (size_t addr = 0; addr < N; ++addr)
+                memory[addr] = lanes.cell(addr, lane);
+            lanes.errors[lane] = nullptr;
+            try {
+                load_declarations<Type, N>(code, size, memory.data());
+                Flags<Type> flags;
+                threaded.execute(memory.data(), flags);
+            } catch (const char *message) {
+                lanes.errors[lane] = message;
+            }
+            for (size_t addr = 0; addr < N; ++addr)
+                lanes.cell(addr, lane) = memory[addr];
+        }
+    }
+};
+
+#undef TMPASM_VECTOR_BYTES
+
+#endif // LOCKSTEP_H
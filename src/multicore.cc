@@ -0,0 +1,132 @@
+#include "multicore.h"
+#include <array>
+#include <iostream>
+#include <thread>
+
+constexpr size_t ITERATIONS = 100000;
+
+// Cores at once, also more than hardware threads.
+constexpr size_t CORES = 8;
+
+// Adds 1 to the counter ITERATIONS times.
+using tmpasm_counter = Program<
+        D<Id("count"), Num<0>>,
+        Mov<Reg<2>, Num<ITERATIONS>>,
+        Label<Id("loop")>,
+        Mov<Reg<1>, Num<1>>,
+        Xadd<Mem<Lea<Id("count")>>, Reg<1>>,
+        Dec<Reg<2>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+// Adds 1 to the total ITERATIONS times, holding the lock.
+using tmpasm_locked = Program<
+        D<Id("lock"), Num<0>>,
+        D<Id("total"), Num<0>>,
+        Mov<Reg<2>, Num<ITERATIONS>>,
+        Label<Id("loop")>,
+        Mov<Reg<1>, Num<0>>,
+        CmpXchg<Mem<Lea<Id("lock")>>, Reg<1>, Num<1>>,
+        Jz<Id("locked")>,
+        Jmp<Id("loop")>,
+        Label<Id("locked")>,
+        Inc<Mem<Lea<Id("total")>>>,
+        Mov<Reg<1>, Num<-1>>,
+        Xadd<Mem<Lea<Id("lock")>>, Reg<1>>,
+        Dec<Reg<2>>,
+        Jz<Id("end")>,
+        Jmp<Id("loop")>,
+        Label<Id("end")>>;
+
+// Publishes data, then sets the flag.
+using tmpasm_producer = Program<
+        D<Id("flag"), Num<0>>,
+        D<Id("data"), Num<0>>,
+        Mov<Mem<Lea<Id("data")>>, Num<42>>,
+        Fence,
+        Mov<Reg<1>, Num<1>>,
+        Xadd<Mem<Lea<Id("flag")>>, Reg<1>>>;
+
+// Waits for the flag, then copies data.
+using tmpasm_consumer = Program<
+        D<Id("flag"), Num<0>>,
+        D<Id("data"), Num<0>>,
+        D<Id("copy"), Num<0>>,
+        Label<Id("wait")>,
+        Mov<Reg<1>, Num<0>>,
+        Xadd<Mem<Lea<Id("flag")>>, Reg<1>>,
+        Cmp<Reg<1>, Num<0>>,
+        Jz<Id("wait")>,
+        Fence,
+        Mov<Mem<Lea<Id("copy")>>, Mem<Lea<Id("data")>>>>;
+
+// Variable a of the second program is loaded after that of the first one.
+using tmpasm_first = Program<
+        D<Id("a"), Num<5>>,
+        Mov<Mem<Num<1>>, Mem<Num<0>>>>;
+
+using tmpasm_second = Program<
+        D<Id("a"), Num<7>>>;
+
+// Flags of the last instruction are returned.
+using tmpasm_compare = Program<
+        Cmp<Num<1>, Num<1>>>;
+
+bool check(bool condition, const char *name) {
+    if (!condition)
+        std::cerr << "Failed [" << name << "]." << std::endl;
+    return condition;
+}
+
+template<typename Type>
+bool counter() {
+    std::array<Type, 1> memory{};
+    auto cores = MulticoreComputer<1, Type>::template run<tmpasm_counter, CORES>(memory);
+    bool ok = memory[0] == static_cast<Type>(CORES * ITERATIONS);
+    for (size_t i = 0; i < CORES; ++i) {
+        ok &= cores[i].error == nullptr && cores[i].ZF &&
+              cores[i].registers[0] == static_cast<Type>(i) && cores[i].registers[2] == 0;
+    }
+    return check(ok, "tmpasm_counter");
+}
+
+template<typename Type>
+bool locked() {
+    std::array<Type, 2> memory{};
+    auto cores = MulticoreComputer<2, Type>::template run<tmpasm_locked, CORES>(memory);
+    bool ok = memory[0] == 0 && memory[1] == static_cast<Type>(CORES * ITERATIONS);
+    for (const auto &core : cores)
+        ok &= core.error == nullptr;
+    return check(ok, "tmpasm_locked");
+}
+
+bool fence() {
+    bool ok = true;
+    for (int i = 0; i < 100; ++i) {
+        std::array<int, 3> memory{};
+        auto cores = MulticoreComputer<3, int>::run<tmpasm_consumer, tmpasm_producer>(memory);
+        ok &= memory[0] == 1 && memory[1] == 42 && memory[2] == 42 &&
+              cores[0].error == nullptr && cores[1].error == nullptr;
+    }
+    return check(ok, "tmpasm_producer");
+}
+
+bool variables() {
+    std::array<int, 4> memory{};
+    auto cores = MulticoreComputer<4, int>::run<tmpasm_first, tmpasm_second>(memory);
+    return check(memory[0] == 7 && memory[1] == 7 && cores[0].error == nullptr, "tmpasm_first");
+}
+
+bool flags() {
+    std::array<int, 1> memory{};
+    auto cores = MulticoreComputer<1, int>::run<tmpasm_compare, 1>(memory);
+    return check(cores[0].ZF && !cores[0].SF && cores[0].error == nullptr, "tmpasm_compare");
+}
+
+int main() {
+    bool ok = counter<int8_t>() & counter<uint16_t>() & counter<int32_t>() &
+              counter<uint64_t>() & locked<int16_t>() & locked<int64_t>() & fence() &
+              variables() & flags();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+#ifndef MULTICORE_H
+#define MULTICORE_H
+
+#include "computer.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Runs programs on cores sharing one memory, every core on its own thread with its own
+// pc, flags and registers. Register 0 of a core holds its number when it starts.
+// Xadd and CmpXchg are sequentially consistent and Fence is a full barrier. Other
+// instructions access memory without synchronization: a cell written by one core while
+// others access it has to be accessed with Xadd or CmpXchg (Xadd of 0 reads it).
+template<size_t N, typename Type>
+class MulticoreComputer {
+    static_assert(std::is_integral<Type>::value, "Computer requires integral types.");
+    static_assert(!std::is_same<Type, bool>::value, "Bool does not have unsigned version");
+
+public:
+    struct Core {
+        // Flags after the program of the core.
+        bool ZF = false, SF = false;
+        std::array<Type, REGISTERS> registers{};
+        // Error thrown by the program of the core, nullptr if there was none.
+        const char *error = nullptr;
+    };
+
+    // Runs program T on cores at once, e.g. workers which split data by their number.
+    template<typename T, size_t cores>
+    static std::array<Core, cores> run(std::array<Type, N> &memory) {
+        static_assert(cores > 0, "Computer requires a core");
+        const ThreadedCode<Type, N> &code = prepare<T>();
+
+        memory.fill(0);
+        T::template load_variables<N, Type, 0>(memory.data());
+
+        std::array<const ThreadedCode<Type, N> *, cores> programs;
+        programs.fill(&code);
+        std::array<Core, cores> ans;
+        execute(programs.data(), ans.data(), cores, memory.data());
+        return ans;
+    }
+
+    // Runs program T[i] on core i. Variables of programs are loaded in order of cores,
+    // so programs declaring the same variables in the same order share them.
+    template<typename... T>
+    static std::array<Core, sizeof...(T)> run(std::array<Type, N> &memory) {
+        static_assert(sizeof...(T) > 0, "Computer requires a core");
+        std::array<const ThreadedCode<Type, N> *, sizeof...(T)> programs{&prepare<T>()...};
+
+        memory.fill(0);
+        (T::template load_variables<N, Type, 0>(memory.data()), ...);
+
+        std::array<Core, sizeof...(T)> ans;
+        execute(programs.data(), ans.data(), sizeof...(T), memory.data());
+        return ans;
+    }
+
+    // Runs decoded instructions (e.g. parsed from TMPAsm source) of programs[i] on core i.
+    static std::vector<Core> run(const std::vector<std::vector<Instruction>> &programs,
+                                 std::array<Type, N> &memory) {
+        if (programs.empty())
+            throw "Computer requires a core";
+        std::vector<ThreadedCode<Type, N>> code;
+        code.reserve(programs.size());
+        memory.fill(0);
+        for (const std::vector<Instruction> &program : programs) {
+            code.emplace_back(program.data(), program.size());
+            load_declarations<Type, N>(program.data(), program.size(), memory.data());
+        }
+
+        std::vector<const ThreadedCode<Type, N> *> pointers;
+        for (const ThreadedCode<Type, N> &program : code)
+            pointers.push_back(&program);
+        std::vector<Core> ans(programs.size());
+        execute(pointers.data(), ans.data(), programs.size(), memory.data());
+        return ans;
+    }
+
+private:
+    template<typename T>
+    static const ThreadedCode<Type, N> &prepare() {
+        T::template check_program<N, Type>();
+
+        // Not optimized: memory holds variables of other programs and is written by other
+        // cores, and flags of the core are returned.
+        static constexpr auto code = Bytecode<T>::decode();
+        static const ThreadedCode<Type, N> threaded(code.data(), code.size());
+        return threaded;
+    }
+
+    // Runs cores on threads, the calling thread is core 0.
+    static void execute(const ThreadedCode<Type, N> *const *programs, Core *cores,
+                        size_t count, Type *memory) {
+        std::atomic<size_t> waiting{count};
+        std::vector<std::thread> threads;
+        threads.reserve(count - 1);
+        for (size_t i = 1; i < count; ++i) {
+            threads.emplace_back([=, &waiting] {
+                start(*programs[i], cores[i], i, memory, waiting);
+            });
+        }
+        start(*programs[0], cores[0], 0, memory, waiting);
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    // Cores wait for each other, so that short programs run at the same time too.
+    static void start(const ThreadedCode<Type, N> &program, Core &core, size_t number,
+                      Type *memory, std::atomic<size_t> &waiting) {
+        core.registers[0] = static_cast<Type>(number);
+        waiting.fetch_sub(1, std::memory_order_acq_rel);
+        while (waiting.load(std::memory_order_acquire) != 0)
+            std::this_thread::yield();
+        try {
+            NoTracer tracer;
+            Flags<Type> flags;
+            program.execute(memory, core.registers.data(), flags, tracer);
+            core.ZF = flags.ZF();
+            core.SF = flags.SF();
+        } catch (const char *message) {
+            core.error = message;
+        }
+    }
+};
+
+#endif // MULTICORE_H
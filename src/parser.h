@@ -0,0 +1,425 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include "computer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Error in TMPAsm source, with number of the line it was found in.
+struct ParseError : std::runtime_error {
+    size_t line;
+
+    ParseError(size_t line, const std::string &message)
+            : std::runtime_error("line " + std::to_string(line) + ": " + message), line(line) {}
+};
+
+namespace {
+//-----------------SOURCE PARSING-----------------
+    // Parses TMPAsm source line by line into decoded instructions, like Bytecode does with
+    // Program types. One instruction per line:
+    //   D a 5            - declaration, D<Id("a"), Num<5>>
+    //   mov [a], [[10]]  - Mov<Mem<Lea<Id("a")>>, Mem<Mem<Num<10>>>>
+    //   cmp a, 'h'       - Cmp<Lea<Id("a")>, Num<'h'>>, lea a is the same as a
+    //   add reg 1, [reg 0] - Add<Reg<1>, Mem<Reg<0>>>
+    //   label stop       - Label<Id("stop")>, stop: is the same
+    //   jz stop          - Jz<Id("stop")>
+    //   call f, a, 2     - Call<Id("f"), Lea<Id("a")>, Num<2>>, memoized, call f is not
+    //   ret              - Ret
+    //   hlt              - Hlt
+    //   fill [a], 4, 0   - Fill<Mem<Lea<Id("a")>>, Num<4>, Num<0>>
+    //   copy [a], [8], n - Copy<Mem<Lea<Id("a")>>, Mem<Num<8>>, Lea<Id("n")>>
+    //   cmprange [a], [8], [n] - CmpRange<Mem<Lea<Id("a")>>, Mem<Num<8>>, Mem<Lea<Id("n")>>>
+    //   in [a], 0        - In<Mem<Lea<Id("a")>>, Num<0>>
+    //   out 1, [a]       - Out<Num<1>, Mem<Lea<Id("a")>>>
+    //   xadd [a], reg 1  - Xadd<Mem<Lea<Id("a")>>, Reg<1>>
+    //   cmpxchg [a], reg 1, 5 - CmpXchg<Mem<Lea<Id("a")>>, Reg<1>, Num<5>>
+    //   fence            - Fence
+    // Mnemonics are case insensitive, ; starts a comment.
+    class Parser {
+        std::vector<Instruction> code;
+        // Line of every instruction, to report unresolved Ids.
+        std::vector<size_t> lines;
+        // Ids of the first label and variable declarations.
+        std::unordered_map<uint64_t, size_t> labels, variables;
+        size_t var_count = 0;
+        size_t line_number = 0;
+
+        std::string_view rest;
+
+        [[noreturn]] void error(const std::string &message) const {
+            throw ParseError(line_number, message);
+        }
+
+        static bool is_space(char c) {
+            return c == ' ' || c == '\t' || c == '\r' || c == ',';
+        }
+
+        static bool is_word_char(char c) {
+            return ('0' <= c && c <= '9') || ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+                   c == '-' || c == '+' || c == '_';
+        }
+
+        void skip_spaces() {
+            size_t i = 0;
+            while (i < rest.size() && is_space(rest[i]))
+                ++i;
+            rest.remove_prefix(i);
+        }
+
+        // Gets next word (identifier or number), empty if there is none.
+        std::string_view word() {
+            skip_spaces();
+            size_t i = 0;
+            while (i < rest.size() && is_word_char(rest[i]))
+                ++i;
+            std::string_view ans = rest.substr(0, i);
+            rest.remove_prefix(i);
+            return ans;
+        }
+
+        bool consume(char c) {
+            skip_spaces();
+            if (rest.empty() || rest[0] != c)
+                return false;
+            rest.remove_prefix(1);
+            return true;
+        }
+
+        // Encodes identifier with Id rules.
+        uint64_t id(std::string_view name) const {
+            // Longer names are cut to be rejected by Id as too long.
+            char buffer[MAX_ID_LEN + 2] = {};
+            name.copy(buffer, MAX_ID_LEN + 1);
+            try {
+                return Id(buffer);
+            } catch (const char *message) {
+                error(std::string(message) + " '" + std::string(name) + "'");
+            }
+        }
+
+        static bool equal_nocase(std::string_view a, std::string_view b) {
+            if (a.size() != b.size())
+                return false;
+            for (size_t i = 0; i < a.size(); ++i) {
+                char c = a[i];
+                if ('A' <= c && c <= 'Z')
+                    c = static_cast<char>(c - 'A' + 'a');
+                if (c != b[i])
+                    return false;
+            }
+            return true;
+        }
+
+        static bool is_number(std::string_view w) {
+            return !w.empty() && (('0' <= w[0] && w[0] <= '9') || w[0] == '-' || w[0] == '+');
+        }
+
+        // Parses decimal or 0x hexadecimal integer, Num keeps its sign separately.
+        Operand number(std::string_view w) const {
+            Operand op{NUM};
+            if (w[0] == '-' || w[0] == '+') {
+                op.negative = w[0] == '-';
+                w.remove_prefix(1);
+            }
+            uint64_t base = 10;
+            if (w.size() > 2 && w[0] == '0' && (w[1] == 'x' || w[1] == 'X')) {
+                base = 16;
+                w.remove_prefix(2);
+            }
+            if (w.empty())
+                error("Invalid number");
+            for (char c : w) {
+                uint64_t digit;
+                if ('0' <= c && c <= '9')
+                    digit = c - '0';
+                else if (base == 16 && 'a' <= c && c <= 'f')
+                    digit = c - 'a' + 10;
+                else if (base == 16 && 'A' <= c && c <= 'F')
+                    digit = c - 'A' + 10;
+                else
+                    error("Invalid number '" + std::string(w) + "'");
+                if (op.value > (UINT64_MAX - digit) / base)
+                    error("Number out of range");
+                op.value = op.value * base + digit;
+            }
+            if (op.negative) {
+                if (op.value > uint64_t(1) << 63)
+                    error("Number out of range");
+                op.value = -op.value;
+                op.negative = op.value != 0;
+            }
+            return op;
+        }
+
+        // Parses pvalue: Mem is [pvalue], Num is a number or a character, Reg is reg and
+        // a number, Lea is an Id.
+        Operand pvalue() {
+            if (consume('[')) {
+                Operand op = pvalue();
+                if (!consume(']'))
+                    error("Expected ]");
+                ++op.depth;
+                return op;
+            }
+            if (consume('\'')) {
+                if (rest.size() < 2 || rest[1] != '\'')
+                    error("Invalid character");
+                char c = rest[0];
+                Operand op{NUM, static_cast<uint64_t>(c), is_negative(c)};
+                rest.remove_prefix(2);
+                return op;
+            }
+            std::string_view w = word();
+            if (w.empty())
+                error("Expected operand");
+            if (is_number(w))
+                return number(w);
+            // Reg followed by a space is a register, otherwise (e.g. reg, or reg]) an Id.
+            if (equal_nocase(w, "reg") && !rest.empty() && (rest[0] == ' ' || rest[0] == '\t')) {
+                std::string_view index = word();
+                if (!is_number(index))
+                    error("Register requires a number");
+                Operand op = number(index);
+                if (op.negative || op.value >= REGISTERS)
+                    error("Register out of register file");
+                return {REG, op.value, false, 1};
+            }
+            if (equal_nocase(w, "lea")) {
+                std::string_view name = word();
+                if (!name.empty())
+                    w = name;
+            }
+            // Address is resolved when all declarations are known.
+            return {LEA, id(w)};
+        }
+
+        Operand lvalue() {
+            Operand op = pvalue();
+            if (op.depth == 0)
+                error("Invalid lvalue, expected memory access");
+            return op;
+        }
+
+        // Parses the first cell of a block, registers are not ranges.
+        Operand range() {
+            Operand op = lvalue();
+            if (is_register(op))
+                error("Block range has to be in memory");
+            return op;
+        }
+
+        void add(const Instruction &ins) {
+            code.push_back(ins);
+            lines.push_back(line_number);
+        }
+
+        void label(std::string_view name) {
+            labels.try_emplace(id(name), code.size());
+            add({LABEL});
+        }
+
+        void instruction(std::string_view mnemonic) {
+            static constexpr struct {
+                const char *name;
+                OpType type;
+                // Operands: 0 - none, 1 - lvalue, 2 - lvalue and pvalue, 3 - two pvalues.
+                int operands;
+            } mnemonics[] = {
+                {"mov", MOV, 2}, {"add", ADD, 2}, {"sub", SUB, 2}, {"and", AND, 2},
+                {"or", OR, 2}, {"cmp", CMP, 3}, {"inc", INC, 1}, {"dec", DEC, 1},
+                {"not", NOT, 1}, {"jmp", JMP, 0}, {"jz", JZ, 0}, {"js", JS, 0},
+                {"in", IN, 2}, {"out", OUT, 3}
+            };
+
+            if (equal_nocase(mnemonic, "d")) {
+                uint64_t name = id(word());
+                std::string_view w = word();
+                if (!is_number(w))
+                    error("Declaration requires a number");
+                variables.try_emplace(name, var_count++);
+                add({DECL, {}, number(w)});
+                return;
+            }
+            if (equal_nocase(mnemonic, "label")) {
+                label(word());
+                return;
+            }
+            if (equal_nocase(mnemonic, "call")) {
+                Instruction ins{CALL};
+                ins.target = id(word());
+                skip_spaces();
+                if (!rest.empty()) {
+                    ins.arg1 = pvalue();
+                    if (ins.arg1.depth != 0)
+                        error("Memoized cells need a constant");
+                    std::string_view w = word();
+                    if (!is_number(w))
+                        error("Memoized call requires a count");
+                    ins.arg2 = number(w);
+                    if (ins.arg2.negative || ins.arg2.value == 0 || ins.arg2.value > MEMO_CELLS)
+                        error("Invalid count of memoized cells");
+                }
+                add(ins);
+                return;
+            }
+            if (equal_nocase(mnemonic, "ret")) {
+                add({RET});
+                return;
+            }
+            if (equal_nocase(mnemonic, "hlt")) {
+                add({HLT});
+                return;
+            }
+            if (equal_nocase(mnemonic, "fence")) {
+                add({FENCE});
+                return;
+            }
+            if (equal_nocase(mnemonic, "xadd") || equal_nocase(mnemonic, "cmpxchg")) {
+                Instruction ins{equal_nocase(mnemonic, "xadd") ? XADD : CMPXCHG};
+                ins.arg1 = lvalue();
+                ins.arg2 = lvalue();
+                if (ins.type == CMPXCHG)
+                    ins.arg3 = pvalue();
+                add(ins);
+                return;
+            }
+            if (equal_nocase(mnemonic, "fill")) {
+                Instruction ins{FILL};
+                ins.arg1 = range();
+                ins.arg3 = pvalue();
+                ins.arg2 = pvalue();
+                add(ins);
+                return;
+            }
+            if (equal_nocase(mnemonic, "copy") || equal_nocase(mnemonic, "cmprange")) {
+                Instruction ins{equal_nocase(mnemonic, "copy") ? COPY : CMPRANGE};
+                ins.arg1 = range();
+                ins.arg2 = range();
+                ins.arg3 = pvalue();
+                add(ins);
+                return;
+            }
+            for (const auto &m : mnemonics) {
+                if (!equal_nocase(mnemonic, m.name))
+                    continue;
+                Instruction ins{m.type};
+                if (m.operands == 0) {
+                    // Target is resolved when all labels are known.
+                    ins.target = id(word());
+                    ins.arg1 = {NUM, ins.target};
+                } else {
+                    ins.arg1 = m.operands == 3 ? pvalue() : lvalue();
+                    if (m.operands > 1)
+                        ins.arg2 = pvalue();
+                }
+                add(ins);
+                return;
+            }
+            error("Unknown instruction '" + std::string(mnemonic) + "'");
+        }
+
+        void resolve(Operand &op, size_t line) const {
+            if (op.kind != LEA)
+                return;
+            auto it = variables.find(op.value);
+            if (it == variables.end())
+                throw ParseError(line, "Id not found");
+            op.value = it->second;
+        }
+
+    public:
+        // Parses one line of source, without the line break.
+        void line(std::string_view text) {
+            ++line_number;
+            rest = text.substr(0, text.find(';'));
+            std::string_view first = word();
+            if (first.empty()) {
+                skip_spaces();
+                if (!rest.empty())
+                    error("Unexpected '" + std::string(rest.substr(0, 1)) + "'");
+                return;
+            }
+            if (consume(':'))
+                label(first);
+            else
+                instruction(first);
+            skip_spaces();
+            if (!rest.empty())
+                error("Unexpected '" + std::string(rest) + "'");
+        }
+
+        // Resolves labels and variables, like Bytecode does.
+        std::vector<Instruction> finish() {
+            for (size_t pc = 0; pc < code.size(); ++pc) {
+                Instruction &ins = code[pc];
+                if (ins.type == JMP || ins.type == JZ || ins.type == JS || ins.type == CALL) {
+                    auto it = labels.find(ins.target);
+                    if (it == labels.end())
+                        throw ParseError(lines[pc], "Label doesn't exist");
+                    ins.target = it->second;
+                }
+                if (ins.type != DECL) {
+                    resolve(ins.arg1, lines[pc]);
+                    resolve(ins.arg2, lines[pc]);
+                    resolve(ins.arg3, lines[pc]);
+                }
+            }
+            for (size_t pc = 0; pc < code.size(); ++pc) {
+                if (code[pc].type != CALL || code[pc].arg2.value == 0)
+                    continue;
+                try {
+                    check_subroutine(code.data(), code.size(), pc);
+                } catch (const char *message) {
+                    throw ParseError(lines[pc], message);
+                }
+            }
+            return std::move(code);
+        }
+    };
+} // anonymous namespace
+
+// Parses TMPAsm source, reading the stream in fixed size chunks.
+inline std::vector<Instruction> parse_program(std::istream &in) {
+    constexpr size_t CHUNK_SIZE = 1 << 16;
+    Parser parser;
+    std::vector<char> buffer(CHUNK_SIZE);
+    // Beginning of a line continued in the next chunk.
+    std::string partial;
+    while (in) {
+        in.read(buffer.data(), CHUNK_SIZE);
+        std::string_view chunk(buffer.data(), static_cast<size_t>(in.gcount()));
+        size_t end;
+        while ((end = chunk.find('\n')) != std::string_view::npos) {
+            if (partial.empty()) {
+                parser.line(chunk.substr(0, end));
+            } else {
+                partial.append(chunk.substr(0, end));
+                parser.line(partial);
+                partial.clear();
+            }
+            chunk.remove_prefix(end + 1);
+        }
+        partial.append(chunk);
+    }
+    if (!partial.empty())
+        parser.line(partial);
+    return parser.finish();
+}
+
+inline std::vector<Instruction> parse_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open " + path);
+    return parse_program(in);
+}
+
+#endif // PARSER_H
@@ -0,0 +1,99 @@
+#ifndef PORTS_H
+#define PORTS_H
+
+#include "computer.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+//-----------------PORT STREAMS-------------------
+    // Input of a port from a file mapped to memory, In reads its words in place. Bytes after
+    // the last whole word are not read.
+    template<typename memType>
+    class MappedInput : public PortStream<memType> {
+        void *pages = MAP_FAILED;
+        size_t pages_size = 0;
+        bool read_once = false;
+
+    public:
+        explicit MappedInput(const char *path) {
+            int fd = open(path, O_RDONLY);
+            if (fd < 0)
+                throw "Cannot open input file";
+            struct stat info;
+            if (fstat(fd, &info) == 0) {
+                pages_size = static_cast<size_t>(info.st_size);
+                // Empty files cannot be mapped, they have no words anyway.
+                if (pages_size < sizeof(memType))
+                    pages = nullptr;
+                else
+                    pages = mmap(nullptr, pages_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+            if (pages == MAP_FAILED)
+                throw "Cannot map input file";
+            if (pages)
+                madvise(pages, pages_size, MADV_SEQUENTIAL);
+        }
+
+        MappedInput(const MappedInput &) = delete;
+        MappedInput &operator=(const MappedInput &) = delete;
+
+        ~MappedInput() override {
+            if (pages)
+                munmap(pages, pages_size);
+        }
+
+        // The whole file is one buffer.
+        bool read(const memType *&next, const memType *&end) override {
+            if (read_once || !pages)
+                return false;
+            read_once = true;
+            next = static_cast<const memType *>(pages);
+            end = next + pages_size / sizeof(memType);
+            return true;
+        }
+    };
+
+    // Output of a port to a file, Out writes to a buffer of words written when it is full.
+    template<typename memType>
+    class BufferedOutput : public PortStream<memType> {
+        static constexpr size_t BUFFER_SIZE = (1 << 16) / sizeof(memType);
+
+        std::FILE *file;
+        std::vector<memType> buffer;
+
+    public:
+        explicit BufferedOutput(const char *path)
+                : file(std::fopen(path, "wb")), buffer(BUFFER_SIZE) {
+            if (!file)
+                throw "Cannot open output file";
+        }
+
+        BufferedOutput(const BufferedOutput &) = delete;
+        BufferedOutput &operator=(const BufferedOutput &) = delete;
+
+        ~BufferedOutput() override {
+            std::fclose(file);
+        }
+
+        void write(memType *&next, memType *&end) override {
+            if (next) {
+                size_t count = static_cast<size_t>(next - buffer.data());
+                if (std::fwrite(buffer.data(), sizeof(memType), count, file) != count ||
+                    std::fflush(file) != 0)
+                    throw "Cannot write output file";
+            }
+            next = buffer.data();
+            end = next + buffer.size();
+        }
+    };
+} // anonymous namespace
+
+#endif // PORTS_H
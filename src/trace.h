@@ -0,0 +1,471 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "computer.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Binary trace file:
+//   header   "TMPT", version, word size, word signedness, memory size, register count,
+//            instruction count, instructions (type, arg1, arg2, arg3, target), initial memory
+//   records  flags byte, pc (if PC) and the write (if WRITE)
+//   end      END byte, error message length and the message (empty if the program finished)
+// Integers are LEB128 varints, signed ones zigzag encoded. Pc is stored as a difference from
+// the next pc and only when it is not the next pc, the address of a write as a difference from
+// the previous one and the new value as a difference from the old one. Old values are not
+// stored, a reader replaying the writes knows them. Registers are written as cells after
+// memory, they are zero at the start. Most records take one to three bytes.
+namespace {
+//-----------------TRACE FORMAT-------------------
+    constexpr char TRACE_MAGIC[4] = {'T', 'M', 'P', 'T'};
+    constexpr uint8_t TRACE_VERSION = 1;
+
+    // Bits of the flags byte of a record.
+    enum TraceFlag : uint8_t {
+        TRACE_ZF = 1, TRACE_SF = 2,
+        // Record has a write.
+        TRACE_WRITE = 4,
+        // Another write of the instruction of the previous record.
+        TRACE_MORE = 8,
+        // Record has a pc.
+        TRACE_PC = 16,
+        TRACE_END = 128
+    };
+
+    // Longest record: flags, pc, address and value.
+    constexpr size_t TRACE_RECORD_MAX = 1 + 3 * 10;
+    constexpr size_t TRACE_CHUNK = 1 << 18;
+
+    constexpr uint64_t zigzag(uint64_t val) {
+        return val << 1 ^ (static_cast<int64_t>(val) < 0 ? UINT64_MAX : 0);
+    }
+
+    constexpr uint64_t unzigzag(uint64_t val) {
+        return val >> 1 ^ (0 - (val & 1));
+    }
+
+// Records are encoded in handlers of the interpreter, a call per step costs as much as the
+// encoding.
+#if defined(__GNUC__)
+#define TMPASM_TRACE_INLINE __attribute__((always_inline))
+#else
+#define TMPASM_TRACE_INLINE
+#endif
+
+//-----------------TRACE RING---------------------
+    // Single producer, single consumer queue of encoded chunks of a trace. Both sides keep
+    // their own index and read the other one only when the queue seems full or empty.
+    class TraceRing {
+        static constexpr size_t CHUNKS = 8;
+
+        std::unique_ptr<uint8_t[]> data{new uint8_t[CHUNKS * TRACE_CHUNK]};
+        size_t sizes[CHUNKS] = {};
+        alignas(64) std::atomic<size_t> head{0};
+        size_t tail_seen = 0;
+        alignas(64) std::atomic<size_t> tail{0};
+        size_t head_seen = 0;
+        alignas(64) std::atomic<bool> closed{false};
+
+    public:
+        // Chunk to fill, waits while all chunks are queued.
+        uint8_t *acquire() {
+            size_t position = head.load(std::memory_order_relaxed);
+            while (position - tail_seen == CHUNKS) {
+                tail_seen = tail.load(std::memory_order_acquire);
+                if (position - tail_seen == CHUNKS)
+                    std::this_thread::yield();
+            }
+            return data.get() + position % CHUNKS * TRACE_CHUNK;
+        }
+
+        // Queues the acquired chunk with size bytes.
+        void push(size_t size) {
+            size_t position = head.load(std::memory_order_relaxed);
+            sizes[position % CHUNKS] = size;
+            head.store(position + 1, std::memory_order_release);
+        }
+
+        // No chunks are pushed after close.
+        void close() {
+            closed.store(true, std::memory_order_release);
+        }
+
+        // Passes queued chunks to consume, waits for them. Returns false when the queue is
+        // closed and empty.
+        template<typename F>
+        bool pop(F consume) {
+            size_t position = tail.load(std::memory_order_relaxed);
+            while (position == head_seen) {
+                bool was_closed = closed.load(std::memory_order_acquire);
+                head_seen = head.load(std::memory_order_acquire);
+                if (position != head_seen)
+                    break;
+                if (was_closed)
+                    return false;
+                std::this_thread::yield();
+            }
+            for (; position != head_seen; ++position)
+                consume(data.get() + position % CHUNKS * TRACE_CHUNK, sizes[position % CHUNKS]);
+            tail.store(position, std::memory_order_release);
+            return true;
+        }
+    };
+
+//-----------------TRACE WRITER-------------------
+    // Tracer of ThreadedCode. Records are encoded by the traced thread, which is cheaper than
+    // passing them, and full chunks are written to a file by another thread.
+    template<typename memType>
+    class TraceWriter {
+        std::FILE *file;
+        TraceRing ring;
+        uint8_t *chunk, *out, *chunk_end;
+        std::vector<size_t> pcs;
+        size_t size;
+        std::thread thread;
+        uint64_t next_pc = 0, last_address = 0;
+
+        static uint8_t *varint(uint8_t *p, uint64_t val) {
+            while (val >= 0x80) {
+                *p++ = static_cast<uint8_t>(val | 0x80);
+                val >>= 7;
+            }
+            *p++ = static_cast<uint8_t>(val);
+            return p;
+        }
+
+        // Sign and register bits are stored in one byte.
+        void operand(std::vector<uint8_t> &buffer, const Operand &op) {
+            varint(buffer, op.value);
+            buffer.push_back(static_cast<uint8_t>(op.negative | (op.kind == REG) << 1));
+            varint(buffer, op.depth);
+        }
+
+        static void varint(std::vector<uint8_t> &buffer, uint64_t val) {
+            uint8_t bytes[10];
+            buffer.insert(buffer.end(), bytes, varint(bytes, val));
+        }
+
+        // Queues the filled chunk, called before a record when it may not fit.
+        void next_chunk() {
+            ring.push(out - chunk);
+            out = chunk = ring.acquire();
+            chunk_end = chunk + TRACE_CHUNK - TRACE_RECORD_MAX;
+        }
+
+        // Record of an instruction which is not the next one.
+        uint8_t *jump(uint8_t *p, uint8_t flags, uint64_t pc) {
+            uint64_t delta = zigzag(pc - next_pc);
+            next_pc = pc + 1;
+            *p++ = static_cast<uint8_t>(flags | TRACE_PC);
+            return varint(p, delta);
+        }
+
+        static uint8_t bits(const Flags<memType> &flags) {
+            return static_cast<uint8_t>(flags.ZF() * TRACE_ZF | flags.SF() * TRACE_SF);
+        }
+
+    public:
+        static constexpr bool enabled = true;
+
+        // Writes the header, pcs[op] is the instruction of op in code.
+        TraceWriter(const char *path, const Instruction *code, size_t size,
+                    const std::vector<size_t> &pcs, const memType *memory, size_t memory_size)
+                : file(std::fopen(path, "wb")), pcs(pcs), size(size) {
+            if (!file)
+                throw "Cannot open trace file";
+            std::vector<uint8_t> buffer(TRACE_MAGIC, TRACE_MAGIC + 4);
+            buffer.push_back(TRACE_VERSION);
+            buffer.push_back(sizeof(memType));
+            buffer.push_back(std::is_signed<memType>::value);
+            varint(buffer, memory_size);
+            varint(buffer, REGISTERS);
+            varint(buffer, size);
+            for (size_t pc = 0; pc < size; ++pc) {
+                buffer.push_back(static_cast<uint8_t>(code[pc].type));
+                operand(buffer, code[pc].arg1);
+                operand(buffer, code[pc].arg2);
+                operand(buffer, code[pc].arg3);
+                varint(buffer, code[pc].target);
+            }
+            for (size_t addr = 0; addr < memory_size; ++addr)
+                varint(buffer, zigzag(static_cast<uint64_t>(memory[addr])));
+            std::fwrite(buffer.data(), 1, buffer.size(), file);
+
+            out = chunk = ring.acquire();
+            chunk_end = chunk + TRACE_CHUNK - TRACE_RECORD_MAX;
+            thread = std::thread([this] {
+                while (ring.pop([this](const uint8_t *data, size_t len) {
+                    std::fwrite(data, 1, len, file);
+                }));
+            });
+        }
+
+        TraceWriter(const TraceWriter &) = delete;
+        TraceWriter &operator=(const TraceWriter &) = delete;
+
+        ~TraceWriter() {
+            finish(nullptr);
+        }
+
+        // Bytes may alias members and memory, so they are written through a local pointer
+        // after members are read.
+        TMPASM_TRACE_INLINE void record(size_t op, const Flags<memType> &flags) {
+            uint64_t pc = pcs[op];
+            // Op after the last instruction only ends the program.
+            if (pc == size)
+                return;
+            if (out > chunk_end)
+                next_chunk();
+            uint8_t *p = out;
+            if (pc == next_pc) {
+                next_pc = pc + 1;
+                *p++ = bits(flags);
+            } else {
+                p = jump(p, bits(flags), pc);
+            }
+            out = p;
+        }
+
+        TMPASM_TRACE_INLINE void record(size_t op, const Flags<memType> &flags, size_t address,
+                                        memType old_value, memType new_value, bool first) {
+            uint64_t pc = pcs[op];
+            uint64_t delta = zigzag(address - last_address);
+            uint64_t value = zigzag(static_cast<uint64_t>(new_value) -
+                                    static_cast<uint64_t>(old_value));
+            if (out > chunk_end)
+                next_chunk();
+            uint8_t *p = out;
+            last_address = address;
+            if (!first) {
+                *p++ = static_cast<uint8_t>(bits(flags) | TRACE_WRITE | TRACE_MORE);
+            } else if (pc == next_pc) {
+                next_pc = pc + 1;
+                *p++ = static_cast<uint8_t>(bits(flags) | TRACE_WRITE);
+            } else {
+                p = jump(p, bits(flags) | TRACE_WRITE, pc);
+            }
+            out = varint(varint(p, delta), value);
+        }
+
+        // Ends the trace with the error which stopped the program, if any.
+        void finish(const char *error) {
+            if (!file)
+                return;
+            std::string message = error ? error : "";
+            if (out > chunk_end)
+                next_chunk();
+            *out++ = TRACE_END;
+            ring.push(out - chunk);
+            ring.close();
+            thread.join();
+            std::vector<uint8_t> buffer;
+            varint(buffer, message.size());
+            buffer.insert(buffer.end(), message.begin(), message.end());
+            std::fwrite(buffer.data(), 1, buffer.size(), file);
+            std::fclose(file);
+            file = nullptr;
+        }
+    };
+
+#undef TMPASM_TRACE_INLINE
+
+//-----------------TRACE READER-------------------
+    // Instruction executed in a trace, with cells it wrote.
+    struct TraceStep {
+        struct Write {
+            // Registers follow memory.
+            uint64_t address;
+            int64_t old_value, new_value;
+        };
+
+        size_t pc = 0;
+        bool ZF = false, SF = false;
+        std::vector<Write> writes;
+    };
+
+    // Reads a trace file written by TraceWriter step by step.
+    class TraceReader {
+        std::vector<uint8_t> data;
+        size_t position = 0;
+        uint64_t next_pc = 0, last_address = 0;
+        bool finished = false;
+
+        uint8_t byte() {
+            if (position == data.size())
+                throw "Truncated trace";
+            return data[position++];
+        }
+
+        uint64_t varint() {
+            uint64_t val = 0;
+            for (unsigned shift = 0;; shift += 7) {
+                uint8_t b = byte();
+                if (shift < 64)
+                    val |= static_cast<uint64_t>(b & 0x7F) << shift;
+                if (!(b & 0x80))
+                    return val;
+            }
+        }
+
+        Operand operand() {
+            Operand op;
+            op.value = varint();
+            uint8_t bits = byte();
+            op.negative = bits & 1;
+            op.kind = bits & 2 ? REG : NUM;
+            op.depth = varint();
+            return op;
+        }
+
+        // Word value from low bits of val.
+        int64_t word(uint64_t val) const {
+            if (word_size < 8)
+                val &= (uint64_t(1) << 8 * word_size) - 1;
+            if (is_signed && word_size < 8 && (val >> (8 * word_size - 1) & 1))
+                val |= UINT64_MAX << 8 * word_size;
+            return static_cast<int64_t>(val);
+        }
+
+    public:
+        size_t word_size = 0;
+        bool is_signed = false;
+        std::vector<Instruction> code;
+        // Initial memory and registers, then their values after the last read step.
+        std::vector<int64_t> memory, registers;
+        // Set after the last step, empty if the program finished.
+        std::string error;
+
+        explicit TraceReader(const char *path) {
+            std::FILE *file = std::fopen(path, "rb");
+            if (!file)
+                throw "Cannot open trace file";
+            uint8_t chunk[1 << 16];
+            for (size_t n; (n = std::fread(chunk, 1, sizeof(chunk), file)) > 0;)
+                data.insert(data.end(), chunk, chunk + n);
+            std::fclose(file);
+
+            for (char c : TRACE_MAGIC) {
+                if (byte() != static_cast<uint8_t>(c))
+                    throw "Not a trace file";
+            }
+            if (byte() != TRACE_VERSION)
+                throw "Unsupported trace version";
+            word_size = byte();
+            is_signed = byte() != 0;
+            memory.resize(varint());
+            registers.resize(varint());
+            code.resize(varint());
+            for (Instruction &ins : code) {
+                ins.type = static_cast<OpType>(byte());
+                ins.arg1 = operand();
+                ins.arg2 = operand();
+                ins.arg3 = operand();
+                ins.target = varint();
+            }
+            for (int64_t &cell : memory)
+                cell = word(unzigzag(varint()));
+        }
+
+        // Reads the next step and applies its writes to memory, returns false after the last
+        // one.
+        bool next(TraceStep &step) {
+            if (finished)
+                return false;
+            uint8_t flags = byte();
+            if (flags & TRACE_END) {
+                error.resize(varint());
+                for (char &c : error)
+                    c = static_cast<char>(byte());
+                finished = true;
+                return false;
+            }
+            if (flags & TRACE_MORE)
+                throw "Corrupted trace";
+            step.pc = flags & TRACE_PC ? next_pc + unzigzag(varint()) : next_pc;
+            next_pc = step.pc + 1;
+            step.writes.clear();
+            for (;;) {
+                step.ZF = flags & TRACE_ZF;
+                step.SF = flags & TRACE_SF;
+                if (flags & TRACE_WRITE) {
+                    TraceStep::Write write;
+                    write.address = last_address + unzigzag(varint());
+                    if (write.address >= memory.size() + registers.size())
+                        throw "Corrupted trace";
+                    int64_t &cell = write.address < memory.size() ?
+                                    memory[write.address] :
+                                    registers[write.address - memory.size()];
+                    write.old_value = cell;
+                    write.new_value = word(static_cast<uint64_t>(write.old_value) +
+                                           unzigzag(varint()));
+                    cell = write.new_value;
+                    last_address = write.address;
+                    step.writes.push_back(write);
+                }
+                if (position == data.size() || (data[position] & TRACE_END) ||
+                    !(data[position] & TRACE_MORE))
+                    return true;
+                flags = byte();
+            }
+        }
+    };
+} // anonymous namespace
+
+// Computer running programs like Computer::run, recording every executed instruction with the
+// cell it wrote and flags after it to a trace file. The trace keeps the instructions it refers
+// to, for run<P> these are the optimized ones.
+template<size_t N, typename Type>
+struct TracingComputer {
+    static_assert(std::is_integral<Type>::value, "Computer requires integral types.");
+    static_assert(!std::is_same<Type, bool>::value, "Bool does not have unsigned version");
+
+    template<typename T>
+    static void run(std::array<Type, N> &memory, const char *path,
+                    Ports<Type> *ports = nullptr) {
+        T::template check_program<N, Type>();
+
+        static constexpr auto code = optimize<Type, N>(Bytecode<T>::decode());
+        static const ThreadedCode<Type, N> threaded(code.code.data(), code.length);
+
+        memory.fill(0);
+        T::template load_variables<N, Type, 0>(memory.data());
+        execute(threaded, code.code.data(), code.length, memory, path, ports);
+    }
+
+    static void run(const std::vector<Instruction> &code, std::array<Type, N> &memory,
+                    const char *path, Ports<Type> *ports = nullptr) {
+        ThreadedCode<Type, N> threaded(code.data(), code.size());
+
+        memory.fill(0);
+        load_declarations<Type, N>(code.data(), code.size(), memory.data());
+        execute(threaded, code.data(), code.size(), memory, path, ports);
+    }
+
+private:
+    static void execute(const ThreadedCode<Type, N> &threaded, const Instruction *code,
+                        size_t size, std::array<Type, N> &memory, const char *path,
+                        Ports<Type> *ports) {
+        TraceWriter<Type> trace(path, code, size, threaded.instructions(), memory.data(), N);
+        Flags<Type> flags;
+        try {
+            threaded.execute(memory.data(), flags, trace, ports);
+        } catch (const char *message) {
+            trace.finish(message);
+            throw;
+        }
+        trace.finish(nullptr);
+        if (ports)
+            ports->flush();
+    }
+};
+
+#endif // TRACE_H
@@ -0,0 +1,112 @@
+// Prints a trace written by TracingComputer: every executed instruction with the cells it
+// wrote and flags after it, or, with STEP, memory and registers replayed up to that step.
+//
+// Usage: tracedump TRACE [STEP]
+#include "../src/trace.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace {
+    const char *const MNEMONICS[] = {
+        "label", "jmp", "jz", "js", "d", "lea", "mem", "num", "reg", "mov", "and", "or", "not",
+        "add", "sub", "inc", "dec", "cmp", "call", "ret", "hlt", "fill", "copy", "cmprange",
+        "in", "out", "xadd", "cmpxchg", "fence", "loop"
+    };
+
+    std::string operand(const Operand &op) {
+        if (op.kind == REG)
+            return std::string(op.depth - 1, '[') + "reg " + std::to_string(op.value) +
+                   std::string(op.depth - 1, ']');
+        return std::string(op.depth, '[') + (op.negative ? "-" : "") +
+               std::to_string(op.value) + std::string(op.depth, ']');
+    }
+
+    std::string cell(uint64_t address, const TraceReader &trace) {
+        if (address >= trace.memory.size())
+            return "reg " + std::to_string(address - trace.memory.size());
+        return "[" + std::to_string(address) + "]";
+    }
+
+    std::string disassemble(const Instruction &ins) {
+        std::string ans = MNEMONICS[ins.type];
+        switch (ins.type) {
+            case JMP:
+            case JZ:
+            case JS:
+                return ans + " " + std::to_string(ins.target);
+            case CALL:
+                ans += " " + std::to_string(ins.target);
+                if (ins.arg2.value != 0)
+                    ans += ", " + operand(ins.arg1) + ", " + operand(ins.arg2);
+                return ans;
+            case NOT:
+            case INC:
+            case DEC:
+                return ans + " " + operand(ins.arg1);
+            case FILL:
+                return ans + " " + operand(ins.arg1) + ", " + operand(ins.arg3) + ", " +
+                       operand(ins.arg2);
+            case COPY:
+            case CMPRANGE:
+            case CMPXCHG:
+                return ans + " " + operand(ins.arg1) + ", " + operand(ins.arg2) + ", " +
+                       operand(ins.arg3);
+            case RET:
+            case HLT:
+            case LABEL:
+            case FENCE:
+            case LOOP:
+                return ans;
+            default:
+                return ans + " " + operand(ins.arg1) + ", " + operand(ins.arg2);
+        }
+    }
+
+    void print(size_t number, const TraceStep &step, const TraceReader &trace) {
+        std::printf("%8zu %6zu  %-32s %s %s", number, step.pc,
+                    step.pc < trace.code.size() ? disassemble(trace.code[step.pc]).c_str() : "?",
+                    step.ZF ? "ZF" : "  ", step.SF ? "SF" : "  ");
+        for (const TraceStep::Write &write : step.writes) {
+            std::printf("  %s %" PRId64 " -> %" PRId64, cell(write.address, trace).c_str(),
+                        write.old_value, write.new_value);
+        }
+        std::printf("\n");
+    }
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        std::fprintf(stderr, "Usage: %s TRACE [STEP]\n", argv[0]);
+        return 1;
+    }
+    try {
+        TraceReader trace(argv[1]);
+        bool replay = argc == 3;
+        size_t last = replay ? std::strtoull(argv[2], nullptr, 10) : SIZE_MAX;
+
+        TraceStep step;
+        size_t number = 0;
+        for (; number <= last && trace.next(step); ++number) {
+            if (!replay || number == last)
+                print(number, step, trace);
+        }
+        if (replay && number <= last) {
+            std::fprintf(stderr, "Trace has %zu steps\n", number);
+            return 1;
+        }
+        if (replay) {
+            for (size_t addr = 0; addr < trace.memory.size(); ++addr)
+                std::printf("%zu: %" PRId64 "\n", addr, trace.memory[addr]);
+            for (size_t reg = 0; reg < trace.registers.size(); ++reg)
+                std::printf("reg %zu: %" PRId64 "\n", reg, trace.registers[reg]);
+        } else if (!trace.error.empty()) {
+            std::printf("error: %s\n", trace.error.c_str());
+        }
+    } catch (const char *message) {
+        std::fprintf(stderr, "%s\n", message);
+        return 1;
+    }
+    return 0;
+}